@@ -0,0 +1,97 @@
+/*
+ * Time the adblock matcher of surf2 on a generated list.
+ *
+ * usage: bench/adblock [rules [requests]]
+ *
+ * Prints the time to compile the list, to map the compiled list again and
+ * the mean time per request. Fails when a request takes 1us or more.
+ */
+#define main surf2main
+#include "../surf2.c"
+#undef main
+
+static void
+genlist(const char *path, guint rules) {
+	FILE *f;
+	guint i;
+
+	f = fopen(path, "w");
+	fprintf(f, "! generated\n127.0.0.1 localhost\n::1 localhost\n");
+	for (i = 0; i < rules; i++) {
+		switch (i % 5) {
+		case 0:
+		case 1:
+			fprintf(f, "0.0.0.0 ads%u.example.net\n", i);
+			break;
+		case 2:
+		case 3:
+			fprintf(f, "||track%u.example.org^\n", i);
+			break;
+		default:
+			fprintf(f, "/banner%u/*.gif\n", i);
+			break;
+		}
+	}
+	/* patterns without a token are tried on every request */
+	for (i = 0; i < 16; i++)
+		fprintf(f, "*adslot%u*\n", i);
+	fclose(f);
+}
+
+int
+main(int argc, char *argv[]) {
+	gchar *dir, *path, *bin, **urls;
+	guint rules, n, i, hits;
+	gint64 t0, t1, t2, t3;
+	double ns;
+
+	rules = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+	n = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+
+	dir = g_dir_make_tmp("surf2-bench-XXXXXX", NULL);
+	path = g_build_filename(dir, "adblock.txt", NULL);
+	bin = g_strconcat(path, ".bin", NULL);
+	genlist(path, rules);
+
+	/* mostly misses, like the requests of a page */
+	urls = g_new(gchar *, n);
+	for (i = 0; i < n; i++) {
+		switch (i % 10) {
+		case 0:
+			urls[i] = g_strdup_printf("https://ads%u.example.net/"
+			    "x.js", i % rules / 5 * 5);
+			break;
+		case 1:
+			urls[i] = g_strdup_printf("https://cdn.example.com/"
+			    "banner%u/top.gif", i % rules / 5 * 5 + 4);
+			break;
+		default:
+			urls[i] = g_strdup_printf("https://static%u.example.com"
+			    "/assets/app-%u.js?v=%u&lang=en", i % 97, i, i % 13);
+			break;
+		}
+	}
+
+	t0 = g_get_monotonic_time();
+	adblockload(path);
+	t1 = g_get_monotonic_time();
+	blockmap = NULL;
+	adblockload(path);
+	t2 = g_get_monotonic_time();
+	for (hits = 0, i = 0; i < n; i++)
+		hits += adblocked(urls[i]);
+	t3 = g_get_monotonic_time();
+
+	ns = (t3 - t2) * 1000.0 / n;
+	printf("rules %u, requests %u, blocked %u\n", rules, n, hits);
+	printf("compile %.1f ms, map %.3f ms, %.0f ns per request\n",
+	    (t1 - t0) / 1000.0, (t2 - t1) / 1000.0, ns);
+	printf("localhost %s\n", adblocked("http://localhost:8000/")
+	    ? "blocked" : "allowed");
+
+	unlink(bin);
+	unlink(path);
+	rmdir(dir);
+
+	return ns < 1000 && !adblocked("http://localhost/") ? 0 : 1;
+}
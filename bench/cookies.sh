@@ -0,0 +1,59 @@
+#!/bin/sh
+# Time to the first commit of a local page with cookie jars of 1k, 10k and
+# 100k cookies, stored as text (-q) and in SQLite (-Q). The first SQLite
+# run imports the text jar, the second one only opens the database.
+#
+# usage: bench/cookies.sh [surf2]
+
+surf=${1:-./surf2}
+
+if [ -z "$DISPLAY" ]; then
+	echo "cookies: skipped, needs an X display (xvfb-run make bench)"
+	exit 0
+fi
+
+tmp=$(mktemp -d)
+trap 'kill $srv 2>/dev/null; rm -rf "$tmp"' EXIT INT TERM
+mkdir -p "$tmp/www" "$tmp/home/.surf"
+echo '<html><body>surf2 bench</body></html>' > "$tmp/www/index.html"
+
+port=$(python3 -c 'import socket; s = socket.socket();
+s.bind(("127.0.0.1", 0)); print(s.getsockname()[1])')
+python3 -m http.server -b 127.0.0.1 -d "$tmp/www" "$port" \
+	>/dev/null 2>&1 &
+srv=$!
+until python3 -c "import urllib.request;
+urllib.request.urlopen('http://127.0.0.1:$port/')" 2>/dev/null; do
+	sleep 0.1
+done
+
+# ms from the start to the first commit, see trace()
+firstload() {
+	: > "$tmp/trace"
+	HOME=$tmp/home SURF_TRACE=$tmp/trace "$surf" "$@" \
+		"http://127.0.0.1:$port/" >/dev/null 2>&1 &
+	pid=$!
+	i=0
+	while [ $i -lt 300 ] && ! grep -q ' committed$' "$tmp/trace"; do
+		sleep 0.1
+		i=$((i + 1))
+	done
+	kill $pid 2>/dev/null
+	wait $pid 2>/dev/null
+	awk '/ committed$/ { print $3; exit }' "$tmp/trace"
+}
+
+for n in 1000 10000 100000; do
+	awk -v n=$n 'BEGIN {
+		for (i = 0; i < n; i++)
+			printf(".site%d.example\tTRUE\t/\tFALSE\t2000000000" \
+			    "\tc%d\tv%d\n", i % 5000, i, i)
+	}' > "$tmp/home/.surf/surf2cookies.txt"
+	rm -f "$tmp/home/.surf/cookies.sqlite"
+
+	text=$(firstload -q)
+	import=$(firstload -Q)
+	sqlite=$(firstload -Q)
+	printf '%6d cookies: text %s ms, sqlite import %s ms, sqlite %s ms\n' \
+		$n "${text:-?}" "${import:-?}" "${sqlite:-?}"
+done
@@ -0,0 +1,254 @@
+#!/usr/bin/env python3
+#
+# Page load benchmark of surf2 against a local HTTP server.
+#
+# usage: bench/load.py [-s] [-r runs] [-b baseline] [surf2]
+#
+# The corpus is generated into a temporary directory and served with
+# python3 -m http.server: a text-heavy, an image-heavy, a script-heavy
+# page and one with thousands of links. surf2 runs with HOME in the same
+# directory, so its cache, cookies and metrics start empty.
+#
+# Every run starts a fresh surf2 and reports the time from starting the
+# process to the first commit in its SURF_TRACE, then loads every page cold and warm over the
+# control socket and takes their commit and finish times from metricsfile.
+# Timings are the median over the runs, the peak resident sizes of the UI
+# and the web process the maximum. WebKitGTK has no first paint signal,
+# the first commit is the earliest point at which the page can paint.
+#
+# With -s the results are stored as the baseline, otherwise they are
+# compared with it and a metric more than 20% worse fails. The numbers
+# only mean something on the machine they were taken on, so no baseline
+# is shipped: record one with make bench-baseline before changing surf2,
+# make bench fails without it.
+
+import json, os, shutil, socket, statistics, subprocess, sys, tempfile
+import time
+
+PAGES = ["text.html", "images.html", "scripts.html", "links.html"]
+TOLERANCE = 0.20
+
+
+def corpus(d):
+    words = ("lorem ipsum dolor sit amet consectetur adipiscing elit sed "
+             "do eiusmod tempor incididunt ut labore et dolore magna").split()
+    with open(os.path.join(d, "start.html"), "w") as f:
+        f.write("<html><body>start</body></html>\n")
+    with open(os.path.join(d, "text.html"), "w") as f:
+        f.write("<html><body><h1>Text</h1>\n")
+        for i in range(2000):
+            f.write("<p>%s</p>\n" % " ".join(
+                words[(i + j) % len(words)] for j in range(60)))
+        f.write("</body></html>\n")
+    with open(os.path.join(d, "img.svg"), "w") as f:
+        f.write('<svg xmlns="http://www.w3.org/2000/svg" width="64" '
+                'height="64"><rect width="64" height="64" fill="#888"/>'
+                '</svg>\n')
+    with open(os.path.join(d, "images.html"), "w") as f:
+        f.write("<html><body><h1>Images</h1>\n")
+        for i in range(300):
+            f.write('<img src="img.svg?%d" width="64" height="64">\n' % i)
+        f.write("</body></html>\n")
+    for i in range(20):
+        with open(os.path.join(d, "s%d.js" % i), "w") as f:
+            f.write("var s%d = [];\nfor (var i = 0; i < 20000; i++)\n"
+                    "\ts%d.push(Math.sqrt(i) * %d);\n" % (i, i, i))
+    with open(os.path.join(d, "scripts.html"), "w") as f:
+        f.write("<html><head>\n")
+        for i in range(20):
+            f.write('<script src="s%d.js"></script>\n' % i)
+        f.write("</head><body><h1>Scripts</h1><div id=out></div>\n"
+                "<script>\nvar o = document.getElementById('out');\n"
+                "for (var i = 0; i < 5000; i++) {\n"
+                "\tvar e = document.createElement('div');\n"
+                "\te.textContent = 'row ' + i;\n\to.appendChild(e);\n}\n"
+                "</script></body></html>\n")
+    with open(os.path.join(d, "links.html"), "w") as f:
+        f.write("<html><body><h1>Links</h1>\n")
+        for i in range(5000):
+            f.write('<a href="/page/%d">page %d</a><br>\n' % (i, i))
+        f.write("</body></html>\n")
+
+
+def freeport():
+    s = socket.socket()
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def waitfor(cond, timeout, step=0.05):
+    end = time.monotonic() + timeout
+    while time.monotonic() < end:
+        r = cond()
+        if r:
+            return r
+        time.sleep(step)
+    return None
+
+
+def peakrss(pid):
+    try:
+        with open("/proc/%d/status" % pid) as f:
+            for l in f:
+                if l.startswith("VmHWM:"):
+                    return int(l.split()[1])
+    except OSError:
+        pass
+    return None
+
+
+class Surf:
+    def __init__(self, surf, home, uri):
+        self.home = home
+        self.trace = os.path.join(home, "trace")
+        env = dict(os.environ, HOME=home, SURF_TRACE=self.trace)
+        self.started = time.monotonic()
+        self.p = subprocess.Popen([surf, uri], env=env,
+                                  stdout=subprocess.DEVNULL,
+                                  stderr=subprocess.DEVNULL)
+        self.sock = None
+
+    def phase(self, name):
+        try:
+            with open(self.trace) as f:
+                for l in f:
+                    w = l.split()
+                    if w[-1] == name:
+                        return float(w[2])
+        except OSError:
+            pass
+        return None
+
+    def ctl(self, cmd):
+        if self.sock is None:
+            path = os.path.join(self.home, ".surf",
+                                "surf2-%d.sock" % self.p.pid)
+            waitfor(lambda: os.path.exists(path), 10)
+            self.sock = socket.socket(socket.AF_UNIX)
+            self.sock.connect(path)
+            self.f = self.sock.makefile("r")
+        self.sock.sendall((cmd + "\n").encode())
+        return self.f.readline().strip()
+
+    def metrics(self):
+        try:
+            with open(os.path.join(self.home, ".surf",
+                                   "metrics.jsonl")) as f:
+                return [json.loads(l) for l in f]
+        except OSError:
+            return []
+
+    def quit(self):
+        if self.sock:
+            self.sock.close()
+        self.p.terminate()
+        self.p.wait()
+
+
+def run(surf, base, runs):
+    res = {}
+
+    # every run is a fresh process with an empty cache, medians are kept
+    for r in range(runs):
+        home = tempfile.mkdtemp(dir=base)
+        s = Surf(surf, home, "http://127.0.0.1:%d/start.html" % port)
+        # the trace clock starts in setup(), after exec and the loader
+        if waitfor(lambda: s.phase("committed"), 30, 0.001) is None:
+            s.quit()
+            sys.exit("load: no commit in the trace, see SURF_TRACE")
+        res.setdefault("startup_commit_ms", []).append(
+            (time.monotonic() - s.started) * 1e3)
+
+        xid = json.loads(s.ctl("state"))["clients"][0]["id"]
+        for page in PAGES:
+            uri = "http://127.0.0.1:%d/%s" % (port, page)
+            for kind in ("cold", "warm"):
+                n = len(s.metrics())
+                s.ctl("go %d %s" % (xid, uri))
+                m = waitfor(lambda: [x for x in s.metrics()[n:]
+                                     if x["uri"] == uri], 60)
+                if not m:
+                    s.quit()
+                    sys.exit("load: %s did not finish" % uri)
+                for k in ("commit_ms", "finish_ms"):
+                    res.setdefault("%s_%s_%s" % (page[:-5], kind, k),
+                                   []).append(m[0][k])
+
+        web = json.loads(s.ctl("state"))["clients"][0]["webprocess"]
+        res.setdefault("ui_peak_rss_kib", []).append(peakrss(s.p.pid))
+        if web:
+            res.setdefault("web_peak_rss_kib", []).append(
+                peakrss(web["pid"]))
+        s.quit()
+
+    return {k: max(v) if k.endswith("_kib") else statistics.median(v)
+            for k, v in res.items() if None not in v}
+
+
+def main():
+    global port
+
+    args = sys.argv[1:]
+    save = "-s" in args
+    runs, baseline, surf = 5, "bench/baseline.json", "./surf2"
+    while args:
+        a = args.pop(0)
+        if a == "-r":
+            runs = int(args.pop(0))
+        elif a == "-b":
+            baseline = args.pop(0)
+        elif a != "-s":
+            surf = a
+
+    if not os.environ.get("DISPLAY"):
+        print("load: skipped, needs an X display (xvfb-run make bench)")
+        return 0
+    if not save and not os.path.exists(baseline):
+        print("load: no %s, record it with make bench-baseline" % baseline)
+        return 1
+
+    base = tempfile.mkdtemp(prefix="surf2-bench-")
+    www = os.path.join(base, "www")
+    os.mkdir(www)
+    corpus(www)
+    port = freeport()
+    srv = subprocess.Popen([sys.executable, "-m", "http.server", "-b",
+                            "127.0.0.1", "-d", www, str(port)],
+                           stdout=subprocess.DEVNULL,
+                           stderr=subprocess.DEVNULL)
+    try:
+        waitfor(lambda: socket.socket().connect_ex(("127.0.0.1", port))
+                == 0, 10)
+        res = run(os.path.abspath(surf), base, runs)
+    finally:
+        srv.terminate()
+        srv.wait()
+        shutil.rmtree(base, ignore_errors=True)
+
+    old = {}
+    if not save:
+        with open(baseline) as f:
+            old = json.load(f)
+    worse = 0
+    for k, v in res.items():
+        line = "%-24s %10.1f" % (k, v)
+        if old.get(k):
+            d = (v - old[k]) / old[k]
+            line += "  baseline %10.1f  %+6.1f%%" % (old[k], d * 100)
+            if d > TOLERANCE:
+                line += "  worse"
+                worse += 1
+        print(line)
+
+    if save:
+        with open(baseline, "w") as f:
+            json.dump(res, f, indent=1)
+        print("load: baseline written to %s" % baseline)
+
+    return 1 if worse else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,110 @@
+/*
+ * Time spawning a child from a process of 100 MB and of 1 GB resident,
+ * with fork() and exec as surf2 did and with posix_spawnp() as spawnargv()
+ * does.
+ *
+ * usage: bench/spawn [runs]
+ *
+ * Prints the mean time to start and reap true(1) for each. Fails when
+ * posix_spawnp() at 1 GB takes more than twice its time at 100 MB.
+ */
+#define _GNU_SOURCE
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+static double
+now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double
+viafork(char **argv, int runs) {
+	double t;
+	pid_t pid;
+	int i;
+
+	t = now();
+	for (i = 0; i < runs; i++) {
+		if ((pid = fork()) == 0) {
+			setsid();
+			execvp(argv[0], argv);
+			_exit(127);
+		}
+		waitpid(pid, NULL, 0);
+	}
+
+	return (now() - t) / runs;
+}
+
+static double
+viaspawn(char **argv, int runs) {
+	posix_spawnattr_t attr;
+	double t;
+	pid_t pid;
+	int i;
+
+	posix_spawnattr_init(&attr);
+#ifdef POSIX_SPAWN_SETSID
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+#else
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+#endif
+	t = now();
+	for (i = 0; i < runs; i++) {
+		if (posix_spawnp(&pid, argv[0], NULL, &attr, argv, environ)) {
+			fprintf(stderr, "spawn: cannot spawn %s\n", argv[0]);
+			exit(1);
+		}
+		waitpid(pid, NULL, 0);
+	}
+	posix_spawnattr_destroy(&attr);
+
+	return (now() - t) / runs;
+}
+
+int
+main(int argc, char *argv[]) {
+	static const size_t sizes[] = { 100, 1024 };
+	char *cmd[] = { "true", NULL };
+	double f, s, first;
+	volatile char *mem;
+	size_t i, j;
+	int runs;
+
+	runs = argc > 1 ? atoi(argv[1]) : 200;
+	first = 0;
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		if ((mem = malloc(sizes[i] << 20)) == NULL) {
+			fprintf(stderr, "spawn: cannot allocate %zu MB\n",
+			    sizes[i]);
+			return 1;
+		}
+		/* written page by page, so every page is resident and mapped */
+		for (j = 0; j < sizes[i] << 20; j += 4096)
+			mem[j] = 1;
+
+		f = viafork(cmd, runs);
+		s = viaspawn(cmd, runs);
+		printf("%5zu MB  fork %8.1f us  posix_spawnp %8.1f us\n",
+		    sizes[i], f, s);
+		if (i == 0)
+			first = s;
+		free((char *)mem);
+	}
+
+	if (s > 2 * first) {
+		fprintf(stderr, "spawn: posix_spawnp grows with the RSS\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -3,19 +3,78 @@ static char *useragent      = "Mozilla/5.0 (X11; U; Unix; en-US) "
     "AppleWebKit/601.1 (KHTML, like Gecko) Version/8.0 "
     "Safari/601.1 Surf/"VERSION;
 static char *downloaddir    = "~/";
+static guint maxdownloads   = 4; /* Parallel downloads, 0 for no limit */
+static guint downloadretries = 3; /* Restarts after network errors */
 static char *scriptfile     = "~/.surf/script.js";
+static char *scriptdir      = "~/.surf/scripts/"; /* *.js, see loadscript() */
 static char *stylefile      = "~/.surf/style.css";
-static const gchar *stylewhitelist[] = { "*", };
-static const gchar *styleblacklist[] = { "", };
+static char *socketdir      = "~/.surf/"; /* control socket surf2-<pid>.sock */
+static char *adblockfile    = "~/.surf/adblock.txt"; /* EasyList or hosts(5) */
+static char *styledir       = "~/.surf/styles/"; /* <host>.css per site */
+static char *sessionfile    = "~/.surf/session"; /* restored with -R */
+static char *cachedir       = "~/.surf/cache/"; /* HTTP disk cache, -C */
+static guint cachelimit      = 0;    /* MiB the disk cache is trimmed to,
+                                     * 0 for no limit, -l */
+static WebKitCacheModel cachemodel =
+    WEBKIT_CACHE_MODEL_WEB_BROWSER; /* _DOCUMENT_VIEWER keeps no memory
+                                     * or disk cache, -m/-M */
+static char *hardir         = "~/.surf/har/"; /* see harexport() */
+static guint harmax          = 1000; /* Resources kept per page for the
+                                      * HAR, the oldest go first */
+static char *historyfile    = "~/.surf/history"; /* visited uris, NULL
+                                                * to keep none, -H */
+static guint histresults     = 1000; /* Completions answered at most */
+static char *metricsfile    = "~/.surf/metrics.jsonl"; /* load times of
+                                                  * every page, NULL
+                                                  * for none */
+static const gchar *stylewhitelist[] = { "*://*/*", NULL }; /* WebKit url
+                                                              * patterns */
+static const gchar *styleblacklist[] = { NULL };
 
 static bool kioskmode       = false; /* Ignore shortcuts */
 static bool showindicators  = true;  /* Show indicators in window title */
 static bool runinfullscreen = false; /* Run in fullscreen mode by default */
+static bool inprocesswindows = true; /* Open new windows in this process */
+static WebKitProcessModel processmodel =
+    WEBKIT_PROCESS_MODEL_MULTIPLE_SECONDARY_PROCESSES; /* _SHARED_SECONDARY_
+                                     * PROCESS loads all pages in one web
+                                     * process, -y/-Y */
+static guint webprocesslimit = 0;    /* Web processes at most, the
+                                     * windows share them once there are
+                                     * that many, 0 for no limit, -U */
+static guint poolsize        = 2;    /* Hidden windows kept ready for
+                                     * new windows, 0 to disable */
+static guint batchworkers    = 4;    /* Views loading in parallel in
+                                     * batch mode (-B) */
+static guint batchtimeout    = 30;   /* Seconds per uri, 0 for none */
+static guint deferdelay      = 1000; /* ms after the start at which key
+                                     * bindings, file monitors and cache
+                                     * trimming are set up, if no page
+                                     * committed before */
+static guint discardafter    = 3600; /* Seconds a background window may
+                                     * idle before its page is dropped
+                                     * and reloaded on focus, 0 to keep
+                                     * pages until memory runs low */
+
+static guint prefetchdelay   = 100;  /* ms the pointer rests on a link
+                                     * before its host is resolved and
+                                     * preconnected, 0 to disable */
+static guint prefetchbudget  = 256;  /* Hosts prefetched per session */
+static guint prerenderdwell  = 400;  /* ms the pointer rests on a link
+                                     * to the same site before the page
+                                     * is loaded in a hidden view and
+                                     * shown at once when clicked, 0 to
+                                     * disable */
+static guint prerendermax    = 1;    /* Hidden views loading at once */
 
 static guint defaultfontsize = 16;   /* Default font size */
 static gfloat zoomlevel      = 1.0;  /* Default zoom level */
 
 /* Session default features */
+static WebKitCookiePersistentStorage cookiestorage =
+    WEBKIT_COOKIE_PERSISTENT_STORAGE_TEXT; /* _SQLITE uses cookiedb, a new
+                                            * one imports cookiefile */
+static char *cookiedb       = "~/.surf/cookies.sqlite";
 static char *cookiefile     = "~/.surf/surf2cookies.txt";
 static char *cookiepolicies = "@aA"; /* A: accept all; a: accept nothing,
                                       * @: accept no third party */
@@ -36,6 +95,9 @@ static bool nomediaautoplay       = FALSE;
 static const char *defaultcharset = "UTF-8";
 static WebKitFindOptions findopts = WEBKIT_FIND_OPTIONS_CASE_INSENSITIVE |
     WEBKIT_FIND_OPTIONS_WRAP_AROUND;
+static guint findcap              = 1000; /* Matches counted per search */
+static guint finddelay            = 150;  /* ms after the last key typed
+                                           * before searching */
 
 #define SETPROP(p, q) { \
 	.v = (char *[]){ "/bin/sh", "-c", \
@@ -45,15 +107,13 @@ static WebKitFindOptions findopts = WEBKIT_FIND_OPTIONS_CASE_INSENSITIVE |
 	} \
 }
 
-/* DOWNLOAD(URI, referer) */
-#define DOWNLOAD(d, r) { \
+/* like SETPROP, offering the history as well */
+#define HISTPROP(p, q) { \
 	.v = (char *[]){ "/bin/sh", "-c", \
-		"st -e /bin/sh -c \"" \
-		"cd \"$4\";" \
-		"curl -L -J -O --user-agent '$1'" \
-		" --referer '$2' -b $3 -c $3 '$0';" \
-		"sleep 5;\"", \
-		d, useragent, r, cookiefile, downloaddir, NULL \
+		"prop=\"`{ xprop -id $2 $0 | cut -d '\"' -f 2 | xargs -0 printf %b;" \
+		" \"$3\" -H ''; } | dmenu | cut -d ' ' -f 1`\" &&" \
+		"xprop -id $2 -f $1 8s -set $1 \"$prop\"", \
+		p, q, winid, self, NULL \
 	} \
 }
 
@@ -92,13 +152,15 @@ static Key keys[] = {
     { 0,                     GDK_KEY_F11,    togglefullscreen, { 0 } },
     { 0,                     GDK_KEY_Escape, stop,       { 0 } },
     { MODKEY|GDK_SHIFT_MASK, GDK_KEY_o,      inspector,  { 0 } },
+    { MODKEY|GDK_SHIFT_MASK, GDK_KEY_h,      harexport,  { 0 } },
 
-    { MODKEY,                GDK_KEY_g,      spawn,      SETPROP("_SURF_URI", "_SURF_GO") },
+    { MODKEY,                GDK_KEY_g,      spawn,      HISTPROP("_SURF_URI", "_SURF_GO") },
     { MODKEY,                GDK_KEY_f,      spawn,      SETPROP("_SURF_FIND", "_SURF_FIND") },
     { MODKEY,                GDK_KEY_slash,  spawn,      SETPROP("_SURF_FIND", "_SURF_FIND") },
 
     { MODKEY,                GDK_KEY_n,      find,       { .b = TRUE } },
     { MODKEY|GDK_SHIFT_MASK, GDK_KEY_n,      find,       { .b = FALSE } },
+    { MODKEY|GDK_SHIFT_MASK, GDK_KEY_f,      findstart,  { 0 } },
 
     { MODKEY|GDK_SHIFT_MASK, GDK_KEY_c,      toggle,     { .v = "enable-caret-browsing" } },
     { MODKEY|GDK_SHIFT_MASK, GDK_KEY_i,      toggle,     { .v = "auto-load-images" } },
@@ -108,3 +170,15 @@ static Key keys[] = {
     { MODKEY|GDK_SHIFT_MASK, GDK_KEY_m,      togglestyle, { 0 } },
     { MODKEY|GDK_SHIFT_MASK, GDK_KEY_g,      togglegeolocation, { 0 } },
 };
+
+/*
+ * Per-site settings for a host and its subdomains, in place before the
+ * first request. flags are those of the command line, s/S JavaScript,
+ * i/I images and p/P plugins, and 'a' drops the cookies of the site
+ * after each page. zoom 0 keeps zoomlevel.
+ */
+static Site sites[] = {
+    /* host                  flags   useragent   zoom */
+    /* { "example.com",      "siP",  NULL,       1.2 }, */
+    { NULL },
+};
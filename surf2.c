@@ -1,17 +1,29 @@
+/* for POSIX_SPAWN_SETSID */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <spawn.h>
+#include <time.h>
 #include <unistd.h>
 #include <bsd/string.h>
 #include <libgen.h>
 #include <X11/Xatom.h>
 #include <gtk/gtk.h>
+#include <gtk/gtkunixprint.h>
 #include <gtk/gtkx.h>
 #include <webkit2/webkit2.h>
 #include <glib.h>
@@ -22,8 +34,110 @@
 
 #define LENGTH(x)	(sizeof x / sizeof x[0])
 #define CLEANMASK(mask)	(mask & (MODKEY|GDK_SHIFT_MASK))
+#define SESSIONMAGIC	"surf2ses"
+#define NAVRING		64
+#define FASTUSEC	2000
+#define SCROLLLINE	40	/* pixels WebKit scrolls per unit of wheel delta */
+#define LOWMEMPAUSE	60
+#define HISTMAGIC	"surf2hix"
+#define HISTTAIL	(1 << 20)
+#define BLOCKMAGIC	"surf2abx"
+#define CTLLINE		(64 << 10)
+
+enum _atom { ATOMFIND, ATOMGO, ATOMSTATS, ATOMURI, ATOMLAST };
+
+/* per window toggles in the session file */
+enum _sessflag {
+	SESSCARET   = 1 << 0,
+	SESSIMAGES  = 1 << 1,
+	SESSSCRIPTS = 1 << 2,
+	SESSPLUGINS = 1 << 3,
+};
+
+/* One navigation, times from g_get_monotonic_time(). */
+struct _nav {
+	gint64 date;
+	gint64 started;
+	gint64 committed;
+	gint64 finished;
+	guint redirects;
+	guint resources;
+	guint fastresponses;
+	guint slowresponses;
+	guint64 bytes;
+	gboolean prerendered;
+};
+
+/* A resource of the current navigation, times from g_get_real_time(). */
+struct _har {
+	struct _client *c;
+	WebKitWebView *view;
+	WebKitWebResource *res;
+	gchar *method;
+	gchar *uri;
+	gchar *mime;
+	gchar *error;
+	guint status;
+	guint64 size;
+	gint64 started;
+	gint64 responded;
+	gint64 finished;
+};
+
+/* compiled adblock list, see adblockcompile() */
+struct _blockhdr {
+	char magic[8];
+	gint64 mtime;
+	gint64 mtimensec;
+	guint64 size;
+	guint32 hosts;
+	guint32 tokens;
+	guint32 rules;
+	guint32 patterns;
+};
+
+struct _blocktok {
+	guint32 hash;
+	guint32 first;
+	guint32 count;
+};
+
+/* history index, see histindex() */
+struct _histhdr {
+	char magic[8];
+	guint64 logsize;
+	guint32 entries;
+	guint32 trigrams;
+	guint32 postings;
+	guint32 pad;
+};
+
+struct _histent {
+	guint32 uri;
+	guint32 title;
+	guint32 visits;
+	guint32 last;
+};
 
-enum _atom { ATOMFIND, ATOMGO, ATOMURI, ATOMLAST };
+struct _histtri {
+	guint32 trigram;
+	guint32 first;
+	guint32 count;
+};
+
+struct _histrec {
+	const gchar *uri;
+	const gchar *title;
+	guint visits;
+	gint64 last;
+	gdouble score;
+};
+
+struct _child {
+	gint64 started;
+	void (*done)(gint, gint64, gpointer);
+	gpointer data;
+};
 
 union _arg {
 	gboolean b;
@@ -37,11 +151,25 @@ struct _client {
 	WebKitWebView *view;
 	WebKitFindController *finder;
 	WebKitWebInspector *inspector;
+	WebKitWebView *prerender;
+	WebKitSettings *settings;
+	const struct _site *site;
+	const struct _site *committedsite;
+	WebKitWebViewSessionState *session;
 	const gchar *uri;
+	gchar *sessionuri;
+	GBytes *sessionrecord;
 	gchar *title;
+	gchar *findtext;
+	guint findmatches;
+	guint findtimer;
+	gboolean findcounted;
+	gboolean finding;
+	gboolean histtitled;
 	gchar *hoveruri;
 	gchar *hovertitle;
 	gchar *hovercontent;
+	gchar *prerenderuri;
 	gint cookiepolicy;
 	gint progress;
 	gboolean committed;
@@ -50,10 +178,82 @@ struct _client {
 	gboolean inspecting;
 	gboolean ssl;
 	gboolean sslfailed;
-	gboolean styled;
+	gboolean scrolling;
+	gboolean discarding;
+	gboolean placeholder;
+	gboolean pooled;
+	gint scrollx;
+	gint scrolly;
+	gint pagex;
+	gint pagey;
+	gdouble zoom;
+	gint64 lastseen;
+	pid_t webpid;
+	pid_t prerenderpid;
+	guint procgroup;
+	gint64 prerenderstarted;
+	gint64 prerenderfinished;
+	WebKitLoadEvent prerenderload;
+	guint titleidle;
+	guint prefetchtimer;
+	guint prerendertimer;
+	guint prerenderidle;
+	struct _nav nav;
+	struct _nav navs[NAVRING];
+	guint navcount;
+	GPtrArray *har;
+	GPtrArray *prerenderhar;
+	struct _nav prerendernav;
+	char togglestats[8];
+	char titlebuf[1024];
 	struct _client *next;
 };
 
+enum _dlstate { DLQUEUED, DLACTIVE, DLRETRY, DLDONE };
+
+struct _download {
+	WebKitDownload *download;
+	WebKitWebView *view;
+	gchar *uri;
+	gchar *dest;
+	guint64 received;
+	guint64 total;
+	guint retries;
+	enum _dlstate state;
+	struct _download *next;
+};
+
+/* A view of batch mode, loads one uri of batchfile after the other. */
+struct _batch {
+	GtkWidget *win;
+	WebKitWebView *view;
+	const gchar *uri;
+	guint n;
+	guint timeout;
+	guint pending;
+	guint gen;
+	gint64 started;
+	gint64 committed;
+	gint64 finished;
+	gchar *error;
+	struct _batch *next;
+};
+
+/* One output of a batch uri, dropped when the uri has been given up on. */
+struct _batchout {
+	struct _batch *b;
+	guint gen;
+};
+
+struct _ctl {
+	int fd;
+	GIOChannel *ch;
+	GIOCondition cond;
+	GString *in;
+	GString *out;
+	gboolean eof;
+};
+
 typedef struct _key {
 	guint mod;
 	guint keyval;
@@ -61,293 +261,2510 @@ typedef struct _key {
 	const union _arg arg;
 } Key;
 
+typedef struct _site {
+	const char *host;
+	const char *flags;
+	const char *useragent;
+	gfloat zoom;
+} Site;
+
+extern char **environ;
+
 char *argv0;
 static Display *dpy;
 static Atom atoms[ATOMLAST];
 static struct _client *clients;
+static struct _client *pool;
+static guint poolfiller;
+static guint poolhits;
+static guint poolmisses;
 static Window embed;
 static bool showwinid;
 static bool usingproxy;
 static char winid[21];
+static char self[PATH_MAX];
 static char pagestats[3];
-static char togglestats[8];
 static gint cookiepolicy;
-
+static struct _download *downloads;
+static int ctlfd = -1;
+static gchar *ctlpath;
+static const struct _blockhdr *blockmap;
+static WebKitUserContentFilterStore *filterstore;
+static gchar *filterid;
+static WebKitUserContentManager *contentmanager;
+static WebKitUserStyleSheet *userstyle;
+static GPtrArray *sitestyles;
+static GFileMonitor *stylemon;
+static GFileMonitor *styledirmon;
+static bool styled;
+static bool restore;
+static guint sessionidle;
+static char *batchfile;
+static char *outdir;
+static gchar **batchuris;
+static guint batchnext;
+static guint batchok;
+static guint batcherrors;
+static gint64 batchstarted;
+static struct _batch *batches;
+static gchar *batchprinter;
+static FILE *metricsfp;
+static WebKitWebContext *context;
+static GHashTable *prefetched;
+static guint prerenders;
+static guint procgroups;
+static guint prerenderhits;
+static guint prerendermisses;
+static gint64 prerendersaved;
+static gint64 memorylow;
+static FILE *histfp;
+static char *histquery;
+static gint histindexing;
+static guint64 histindexed;
+static GHashTable *sitetable;
+static FILE *tracefp;
+static gint64 tracestart;
+static gboolean deferred;
+static guint defertimer;
+
+static char *abspath(const char *);
+static GByteArray *adblockcompile(const char *, const struct stat *);
+static gboolean adblocked(const char *);
+static void adblockfilter(void);
+static guint32 adblockhash(const char *, const char *);
+static void adblockjson(GString *, const char *, gboolean);
+static void adblockload(const char *);
+static void adblockloaded(GObject *, GAsyncResult *, gpointer);
+static gboolean adblockmatch(const char *, const char *, const char *,
+    const char *);
+static const struct _blockhdr *adblockopen(const char *,
+    const struct stat *);
+static void adblockpruned(GObject *, GAsyncResult *, gpointer);
+static void adblockrule(char *, GHashTable *, GHashTable *, GPtrArray *);
+static GBytes *adblockrules(void);
+static void adblocksaved(GObject *, GAsyncResult *, gpointer);
 static void addaccelgroup(struct _client *);
+static void applystyles(void);
+static void attachview(struct _client *);
+static gboolean batch(void);
+static struct _batch *batchcurrent(struct _batchout *);
+static void batchdone(struct _batch *);
+static gboolean batchexpired(gpointer);
+static gboolean batchfileprinter(GtkPrinter *, gpointer);
+static void batchloaded(WebKitWebView *, WebKitLoadEvent, struct _batch *);
+static gboolean batchloadfailed(WebKitWebView *, WebKitLoadEvent, gchar *,
+    GError *, struct _batch *);
+static void batchnextfile(struct _batchout *);
+static struct _batchout *batchout(struct _batch *);
+static void batchprinted(WebKitPrintOperation *, struct _batchout *);
+static void batchprintfailed(WebKitPrintOperation *, GError *,
+    struct _batchout *);
+static void batchsnapshot(GObject *, GAsyncResult *, gpointer);
+static void batchstart(struct _batch *);
+static void batchtext(GObject *, GAsyncResult *, gpointer);
 static char *buildpath(const char *);
+static void cachefetched(GObject *, GAsyncResult *, gpointer);
+static gboolean cachetrim(gpointer);
 static void cleanup(void);
 static void clipboard(struct _client *, const union _arg *);
+static gint cmphist(gconstpointer, gconstpointer);
+static gint cmpint64(gconstpointer, gconstpointer);
+static gint cmpsitesize(gconstpointer, gconstpointer);
+static gint cmptrigram(gconstpointer, gconstpointer);
 static gchar *copystr(char **, const char *);
 static WebKitWebView *createwindow(WebKitWebView *, struct _client *);
+static gboolean ctlaccept(GIOChannel *, GIOCondition, gpointer);
+static gboolean ctlclient(GString *, struct _client *, const char *, char *);
+static void ctlcommand(GString *, char *);
+static gboolean ctlio(GIOChannel *, GIOCondition, gpointer);
+static void ctllisten(void);
+static void ctlmetrics(GString *, struct _client *);
+static void ctlpercentiles(GString *, GArray *);
+static void ctlproc(GString *, pid_t, guint);
+static void ctlstate(GString *, struct _client *);
+static gboolean decidedestination(WebKitDownload *, gchar *,
+    struct _download *);
 static gboolean decidepolicy(WebKitWebView *, WebKitPolicyDecision *,
     WebKitPolicyDecisionType, struct _client *);
+static gboolean deferinit(gpointer);
 static void destroyclient(struct _client *);
 static void destroywin(GtkWidget *, struct _client *);
 static void die(const char *, ...);
+static void discard(struct _client *);
+static void discardall(gint64);
+static void discarded(GObject *, GAsyncResult *, gpointer);
+static gboolean discardtick(gpointer);
+static void downloadfailed(WebKitDownload *, GError *, struct _download *);
+static void downloadfinished(WebKitDownload *, struct _download *);
+static void downloadnext(void);
+static void downloadprogress(WebKitDownload *, guint64, struct _download *);
+static void downloadstarted(WebKitWebContext *, WebKitDownload *, gpointer);
+static void downloadwatch(struct _download *, WebKitDownload *);
+static gboolean dropview(gpointer);
+static void exited(gint, gint64, gpointer);
+static gboolean fillpool(gpointer);
 static void find(struct _client *, const union _arg *);
+static void findfailed(WebKitFindController *, struct _client *);
+static gboolean findflush(gpointer);
+static void findfound(WebKitFindController *, guint, struct _client *);
+static gboolean findkeypress(GtkWidget *, GdkEventKey *, struct _client *);
+static void findstart(struct _client *, const union _arg *);
+static gboolean flushtitle(gpointer);
 static const char *getatom(struct _client *, enum _atom);
+static struct _client *getclient(Window);
 static WebKitCookieAcceptPolicy getcookiepolicy(void);
 static void getpagestats(struct _client *);
 static void gettogglestats(struct _client *);
-static gboolean initdownload(struct _client *, const union _arg *);
+static void hardate(char *, size_t, gint64);
+static void harexport(struct _client *, const union _arg *);
+static void harfree(gpointer);
+static gchar *harwrite(struct _client *);
+static void histcomplete(GString *, const char *, gboolean);
+static void histemit(GString *, const char *, const char *, gboolean, guint);
+static gboolean histhas(const char *, const char *);
+static gpointer histindex(gpointer);
+static void histlog(struct _client *, const char *);
+static gboolean histmatch(const char *, const char *, gchar **);
+static guint8 *histopen(gsize *, gboolean);
+static void histtail(GString *, guint64, gchar **, GHashTable *, guint *,
+    gboolean);
+static void histtrigrams(GArray *, const char *);
 static void insecurecontent(WebKitWebView *, WebKitInsecureContentEvent,
     struct _client *);
 static void inspector(struct _client *, const union _arg *);
+static void jsonstr(GString *, const char *);
 static gboolean keypress(GtkAccelGroup *, GObject *, guint, GdkModifierType,
     struct _client *);
 static void loadchanged(WebKitWebView *, WebKitLoadEvent, struct _client *);
+static gboolean loadfailed(WebKitWebView *, WebKitLoadEvent, gchar *,
+    GError *, struct _client *);
 static void loadprogressed(WebKitWebView *, GParamSpec *, struct _client *);
+static void loadscript(const char *);
+static void loadscripts(void);
+static void loadstyles(void);
 static void loaduri(struct _client *, const union _arg *);
+static void lowmemory(GMemoryMonitor *, GMemoryMonitorWarningLevel, gpointer);
 static void mousetargetchanged(WebKitWebView *, WebKitHitTestResult *, guint,
     struct _client *);
+static void navfinished(struct _client *);
 static void navigate(struct _client *, const union _arg *);
-static struct _client *newclient(void);
+static struct _client *newclient(Window, bool);
+static WebKitSettings *newsettings(void);
+static void newview(struct _client *);
 static void newwindow(struct _client *, const union _arg *, bool);
 static void pasteuri(GtkClipboard *, const char *, gpointer);
 static gboolean permissionrequest(WebKitWebView *, WebKitPermissionRequest *,
     struct _client *);
+static gboolean prefetch(gpointer);
+static gboolean prerender(gpointer);
+static void prerenderdrop(struct _client *);
+static void prerendered(WebKitWebView *, WebKitLoadEvent, struct _client *);
+static gboolean prerenderstale(gpointer);
+static void prerenderswap(struct _client *);
 static void print(struct _client *, const union _arg *);
 static GdkFilterReturn processx(GdkXEvent *, GdkEvent *, gpointer);
 static void reload(struct _client *, const union _arg*);
+static void resourcefailed(WebKitWebResource *, GError *, struct _har *);
+static void resourcefinished(WebKitWebResource *, struct _har *);
 static void resourceloadstarted(WebKitWebView *, WebKitWebResource *,
     WebKitURIRequest *, struct _client *);
-static void runjavascript(WebKitWebView *, const char *, ...);
+static struct _nav *resourcenav(struct _har *);
+static void resourcereceived(WebKitWebResource *, guint64, struct _har *);
+static void resourceresponded(WebKitWebResource *, GParamSpec *,
+    struct _har *);
+static guint restoresession(void);
+static gboolean samesite(const gchar *, const gchar *);
+static gboolean savesession(gpointer);
+static void scriptglob(GString *, const char *, const char *);
+static void scriptpattern(GString *, const char *, gboolean);
+static void scroll(struct _client *);
 static void scroll_v(struct _client *, const union _arg *);
 static void scroll_h(struct _client *, const union _arg *);
+static gboolean scrolltick(GtkWidget *, GdkFrameClock *, gpointer);
+static void sessionchanged(struct _client *);
+static const guint8 *sessionget(const guint8 **, const guint8 *, gsize *);
+static void sessionput(GByteArray *, const void *, gsize);
+static GBytes *sessionrecord(struct _client *);
 static void setatom(struct _client *, enum _atom, const char *);
 static char setcookiepolicy(const WebKitCookieAcceptPolicy);
-static void setup(int *, char **[]);
+static void setup(void);
+static void setupcontext(void);
+static void setupcookies(void);
+static void setupsites(void);
+static void setupstyles(void);
 static void show(WebKitWebView *, struct _client *);
-static void sigchld(int);
+static void siteapply(struct _client *, const Site *);
+static void sitecookies(const Site *);
+static void sitecookiesfetched(GObject *, GAsyncResult *, gpointer);
+static gboolean siteflag(const Site *, char, gboolean);
+static const Site *sitelookup(const char *);
+static gboolean sitematch(const char *, const char *);
 static void spawn(struct _client *, const union _arg *);
+static GPid spawnargv(char **, void (*)(gint, gint64, gpointer), gpointer);
+static void spawned(GPid, gint, gpointer);
 static void stop(struct _client *, const union _arg *);
+static void stylechanged(GFileMonitor *, GFile *, GFile *, GFileMonitorEvent,
+    gpointer);
 static void titlechanged(WebKitWebView *, GParamSpec *, struct _client *);
 static void toggle(struct _client *, const union _arg *);
 static void togglecookiepolicy(struct _client *, const union _arg *);
 static void togglefullscreen(struct _client *, const union _arg *);
 static void togglegeolocation(struct _client *, const union _arg *);
 static void togglestyle(struct _client *, const union _arg *);
+static void trace(const char *);
+static void updatepoolstats(void);
 static void updatetitle(struct _client *);
 static void updatewinid(struct _client *);
 static void usage(void);
+static void utf8cut(char *);
+static void wake(struct _client *);
+static void watchstyles(void);
+static pid_t webprocclaim(struct _client *, WebKitWebView *);
+static gboolean webprocclaimed(struct _client *, WebKitWebView *, pid_t);
+static void webprocs(GArray *);
+static WebKitWebView *webprocshare(struct _client *);
+static gboolean webprocstat(pid_t, guint64 *, gdouble *);
+static gboolean winevent(GtkWidget *, GdkEvent *, struct _client *);
 static void zoom(struct _client *, const union _arg *);
 
 #include "config.h"
 
-static void
-addaccelgroup(struct _client *c) {
-	int i;
-	GtkAccelGroup *group;
-	GClosure *closure;
+/* path with ~ expanded and relative to the working directory */
+static char *
+abspath(const char *path) {
+	if (path[0] == '/')
+		return g_strdup(path);
+	if (path[0] == '~' && path[1] == '/')
+		return g_strconcat(g_get_home_dir(), &path[1], NULL);
+	if (path[0] == '~')
+		return g_strconcat(g_get_home_dir(), "/", &path[1], NULL);
 
-	group = gtk_accel_group_new();
+	return g_strconcat(g_get_current_dir(), "/", path, NULL);
+}
 
-	for (i = 0; i < LENGTH(keys); i++) {
-		closure = g_cclosure_new(G_CALLBACK(keypress), c, NULL);
-		gtk_accel_group_connect(group, keys[i].keyval, keys[i].mod,
-		    0, closure);
+/*
+ * Parse the list at path into the layout of struct _blockhdr: the open
+ * addressed tables of hosts and of pattern tokens, the patterns of every
+ * token, the patterns without one and last the strings, all of them
+ * referenced by their offset in the strings.
+ */
+static GByteArray *
+adblockcompile(const char *path, const struct stat *st) {
+	struct _blockhdr h;
+	struct _blocktok *toks;
+	GHashTable *hosts, *tokens;
+	GHashTableIter it;
+	GPtrArray *patterns, *a;
+	GByteArray *b;
+	GArray *rules, *pats;
+	GString *strs;
+	gpointer k, v;
+	gchar *data, *l, *e;
+	guint32 *hosttab, i, j, n, o;
+
+	if (!g_file_get_contents(path, &data, NULL, NULL))
+		return NULL;
+
+	/* rules point into data until they are copied to strs */
+	hosts = g_hash_table_new(g_str_hash, g_str_equal);
+	tokens = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+	    NULL, (GDestroyNotify)g_ptr_array_unref);
+	patterns = g_ptr_array_new();
+	for (l = data; l && *l; l = e) {
+		if ((e = strchr(l, '\n')) != NULL)
+			*e++ = '\0';
+		adblockrule(l, hosts, tokens, patterns);
 	}
-	gtk_window_add_accel_group(GTK_WINDOW(c->win), group);
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, BLOCKMAGIC, sizeof(h.magic));
+	h.mtime = st->st_mtim.tv_sec;
+	h.mtimensec = st->st_mtim.tv_nsec;
+	h.size = st->st_size;
+
+	/* offset 0 is the empty slot */
+	strs = g_string_new_len("", 1);
+
+	for (h.hosts = 1; h.hosts <= 2 * g_hash_table_size(hosts);
+	    h.hosts <<= 1)
+		;
+	hosttab = g_new0(guint32, h.hosts);
+	g_hash_table_iter_init(&it, hosts);
+	while (g_hash_table_iter_next(&it, &k, NULL)) {
+		n = strlen(k);
+		for (i = adblockhash(k, (char *)k + n) & (h.hosts - 1);
+		    hosttab[i]; i = (i + 1) & (h.hosts - 1))
+			;
+		hosttab[i] = strs->len;
+		g_string_append_len(strs, k, n + 1);
+	}
+
+	for (h.tokens = 1; h.tokens <= 2 * g_hash_table_size(tokens);
+	    h.tokens <<= 1)
+		;
+	toks = g_new0(struct _blocktok, h.tokens);
+	rules = g_array_new(FALSE, FALSE, sizeof(guint32));
+	g_hash_table_iter_init(&it, tokens);
+	while (g_hash_table_iter_next(&it, &k, &v)) {
+		a = v;
+		for (i = GPOINTER_TO_UINT(k) & (h.tokens - 1); toks[i].count;
+		    i = (i + 1) & (h.tokens - 1))
+			;
+		toks[i].hash = GPOINTER_TO_UINT(k);
+		toks[i].first = rules->len;
+		toks[i].count = a->len;
+		for (j = 0; j < a->len; j++) {
+			o = strs->len;
+			g_array_append_val(rules, o);
+			g_string_append_len(strs, a->pdata[j],
+			    strlen(a->pdata[j]) + 1);
+		}
+	}
+	h.rules = rules->len;
+
+	pats = g_array_new(FALSE, FALSE, sizeof(guint32));
+	for (j = 0; j < patterns->len; j++) {
+		o = strs->len;
+		g_array_append_val(pats, o);
+		g_string_append_len(strs, patterns->pdata[j],
+		    strlen(patterns->pdata[j]) + 1);
+	}
+	h.patterns = pats->len;
+
+	b = g_byte_array_sized_new(sizeof(h) + h.hosts * sizeof(guint32)
+	    + h.tokens * sizeof(*toks) + (h.rules + h.patterns)
+	    * sizeof(guint32) + strs->len);
+	g_byte_array_append(b, (const guint8 *)&h, sizeof(h));
+	g_byte_array_append(b, (const guint8 *)hosttab,
+	    h.hosts * sizeof(guint32));
+	g_byte_array_append(b, (const guint8 *)toks, h.tokens * sizeof(*toks));
+	g_byte_array_append(b, (const guint8 *)rules->data,
+	    h.rules * sizeof(guint32));
+	g_byte_array_append(b, (const guint8 *)pats->data,
+	    h.patterns * sizeof(guint32));
+	g_byte_array_append(b, (const guint8 *)strs->str, strs->len);
+
+	g_array_free(pats, TRUE);
+	g_array_free(rules, TRUE);
+	g_free(toks);
+	g_free(hosttab);
+	g_string_free(strs, TRUE);
+	g_ptr_array_free(patterns, TRUE);
+	g_hash_table_destroy(tokens);
+	g_hash_table_destroy(hosts);
+	g_free(data);
+
+	return b;
 }
 
-static char *
-buildpath(const char *path) {
-	char *apath, *p;
-	FILE *f;
+static gboolean
+adblocked(const char *uri) {
+	const struct _blocktok *toks;
+	const guint32 *hosts, *rules, *pats;
+	const char *strs;
+	char buf[2048], *h, *he, *p, *e;
+	guint32 hash, i, j;
+
+	if (blockmap == NULL)
+		return FALSE;
+	hosts = (const guint32 *)(blockmap + 1);
+	toks = (const struct _blocktok *)(hosts + blockmap->hosts);
+	rules = (const guint32 *)(toks + blockmap->tokens);
+	pats = rules + blockmap->rules;
+	strs = (const char *)(pats + blockmap->patterns);
 
-	/* creating directory */
-	if (path[0] == '/')
-		apath = g_strdup(path);
-	else if (path[0] == '~') {
-		if (path[1] == '/')
-			apath = g_strconcat(g_get_home_dir(), &path[1], NULL);
-		else
-			apath = g_strconcat(g_get_home_dir(), "/",
-			    &path[1], NULL);
-	} else
-		apath = g_strconcat(g_get_current_dir(), "/", path, NULL);
+	for (i = 0; uri[i] && i < sizeof(buf) - 1; i++)
+		buf[i] = g_ascii_isupper(uri[i]) ? uri[i] - 'A' + 'a' : uri[i];
+	buf[i] = '\0';
 
-	p = strchr(apath, '/');
-	if (p != NULL) {
-		*p = '\0';
-		g_mkdir_with_parents(apath, 0700);
-		g_chmod(apath, 0700); /* in case it existed */
-		*p = '/';
+	if ((h = strstr(buf, "://")) == NULL)
+		return FALSE;
+	h += 3;
+	he = h + strcspn(h, "/?#");
+	for (p = h; p < he; p++)
+		if (*p == '@')
+			h = p + 1;
+	for (p = h; p < he && *p != ':'; p++)
+		;
+	he = p;
+
+	/* host and all of its parent domains */
+	for (p = h; p; p = (p = memchr(p, '.', he - p)) ? p + 1 : NULL) {
+		hash = adblockhash(p, he);
+		for (i = hash & (blockmap->hosts - 1); hosts[i];
+		    i = (i + 1) & (blockmap->hosts - 1))
+			if (!strncmp(strs + hosts[i], p, he - p)
+			    && strs[hosts[i] + (he - p)] == '\0')
+				return TRUE;
 	}
 
-	/* creating file (gives error when apath ends with "/") */
-	f = fopen(apath, "a");
-	if (f != NULL) {
-		g_chmod(apath, 0600); /* always */
-		fclose(f);
+	/* url patterns, looked up by the tokens found in the url */
+	for (p = buf; *p; p = e) {
+		for (; *p && !g_ascii_isalnum(*p); p++)
+			;
+		for (e = p; g_ascii_isalnum(*e); e++)
+			;
+		if (e == p)
+			break;
+		hash = adblockhash(p, e);
+		for (i = hash & (blockmap->tokens - 1); toks[i].count;
+		    i = (i + 1) & (blockmap->tokens - 1)) {
+			if (toks[i].hash != hash)
+				continue;
+			for (j = 0; j < toks[i].count; j++)
+				if (adblockmatch(buf, h, he,
+				    strs + rules[toks[i].first + j]))
+					return TRUE;
+			break;
+		}
 	}
+	for (i = 0; i < blockmap->patterns; i++)
+		if (adblockmatch(buf, h, he, strs + pats[i]))
+			return TRUE;
 
-	return apath;
+	return FALSE;
 }
 
+/*
+ * The web processes block with WebKit's content rules, checked before a
+ * request is sent; the signals of the UI process only report a request
+ * that is already on its way. WebKit compiles the rules once into a
+ * store next to the list. The identifier names the list it was made
+ * from, so a changed list is compiled again.
+ */
 static void
-cleanup(void) {
-	while (clients)
-		destroyclient(clients);
+adblockfilter(void) {
+	gchar *dir;
+
+	if (blockmap == NULL)
+		return;
+
+	dir = g_strconcat(adblockfile, ".filters", NULL);
+	g_mkdir_with_parents(dir, 0700);
+	filterstore = webkit_user_content_filter_store_new(dir);
+	filterid = g_strdup_printf("adblock-%" G_GINT64_FORMAT "-%"
+	    G_GINT64_FORMAT "-%" G_GUINT64_FORMAT, blockmap->mtime,
+	    blockmap->mtimensec, blockmap->size);
+	webkit_user_content_filter_store_load(filterstore, filterid, NULL,
+	    adblockloaded, NULL);
+	g_free(dir);
 }
 
-static void
-clipboard(struct _client *c, const union _arg *arg) {
-	gboolean paste;
-	GtkClipboard *clipboard;
+/* FNV-1a of s..e */
+static guint32
+adblockhash(const char *s, const char *e) {
+	guint32 hash;
 
-	paste = arg->b;
-	clipboard = gtk_clipboard_get(GDK_SELECTION_PRIMARY);
+	for (hash = 2166136261u; s < e; s++)
+		hash = (hash ^ (guchar)*s) * 16777619u;
 
-	if (paste) {
-		gtk_clipboard_request_text(clipboard, pasteuri, c);
-	} else {
-		gtk_clipboard_set_text(clipboard, c->hoveruri
-			? c->hoveruri : c->uri, -1);
+	return hash;
+}
+
+/*
+ * Append the rule pat, a host if host is set, as a WebKit content rule.
+ * The url-filter regular expressions know no alternatives, so a final
+ * '^' is taken as a separator or the end of the url by making the rest
+ * optional. WebKit takes ASCII only, other rules are left out.
+ */
+static void
+adblockjson(GString *s, const char *pat, gboolean host) {
+	const char *p;
+
+	for (p = pat; *p; p++)
+		if ((guchar)*p < 0x20 || (guchar)*p > 0x7e || *p == '\\'
+		    || *p == '"')
+			return;
+
+	g_string_append(s, "{\"trigger\":{\"url-filter\":\"");
+	if (host || (pat[0] == '|' && pat[1] == '|')) {
+		g_string_append(s, "^[a-z][a-z0-9.+-]*://([^/:?#]*\\\\.)?");
+		pat += host ? 0 : 2;
+	} else if (pat[0] == '|') {
+		g_string_append_c(s, '^');
+		pat++;
+	}
+	for (p = pat; *p; p++) {
+		if (*p == '*')
+			g_string_append(s, ".*");
+		else if (*p == '^' && p[1] == '\0')
+			g_string_append(s, "([^a-z0-9_.%-].*)?$");
+		else if (*p == '^')
+			g_string_append(s, "[^a-z0-9_.%-]");
+		else if (*p == '|' && p[1] == '\0')
+			g_string_append_c(s, '$');
+		else if (strchr(".+?()[]{}$|", *p))
+			g_string_append_printf(s, "\\\\%c", *p);
+		else
+			g_string_append_c(s, *p);
 	}
+	if (host)
+		g_string_append(s, "[:/]");
+	g_string_append(s, "\"},\"action\":{\"type\":\"block\"}},");
 }
 
-static gchar *
-copystr(char **dst, const char *src) {
-	gchar *tmp;
+/*
+ * The list is compiled once to path.bin, which is mapped read-only: every
+ * surf2 shares its pages and none parses the list at startup. It is
+ * compiled again when the mtime or the size of the list changed.
+ */
+static void
+adblockload(const char *path) {
+	struct stat st;
+	GByteArray *b;
+	gchar *bin, *tmp;
+	FILE *f;
 
-	tmp = g_strdup(src);
-	if (dst && *dst) {
-		g_free(*dst);
-		*dst = tmp;
+	if (stat(path, &st))
+		return;
+
+	bin = g_strconcat(path, ".bin", NULL);
+	if ((blockmap = adblockopen(bin, &st)) != NULL
+	    || (b = adblockcompile(path, &st)) == NULL) {
+		g_free(bin);
+		return;
 	}
 
-	return tmp;
+	tmp = g_strconcat(bin, ".tmp", NULL);
+	if ((f = fopen(tmp, "w")) != NULL) {
+		fwrite(b->data, 1, b->len, f);
+		if (fclose(f) == 0)
+			rename(tmp, bin);
+		else
+			unlink(tmp);
+	}
+	/* without a writable cache the compiled list stays on the heap */
+	if ((blockmap = adblockopen(bin, &st)) != NULL)
+		g_byte_array_free(b, TRUE);
+	else
+		blockmap = (struct _blockhdr *)g_byte_array_free(b, FALSE);
+
+	g_free(tmp);
+	g_free(bin);
 }
 
-static WebKitWebView *
-createwindow(WebKitWebView *v, struct _client *c) {
-	struct _client *n;
+static void
+adblockloaded(GObject *o, GAsyncResult *r, gpointer unused) {
+	WebKitUserContentFilter *f;
+	GBytes *b;
 
-	n = newclient();
+	f = webkit_user_content_filter_store_load_finish(filterstore, r, NULL);
+	if (f != NULL) {
+		webkit_user_content_manager_add_filter(contentmanager, f);
+		webkit_user_content_filter_unref(f);
+		return;
+	}
 
-	return n->view;
+	/* not compiled yet or from an older list */
+	if ((b = adblockrules()) == NULL)
+		return;
+	webkit_user_content_filter_store_save(filterstore, filterid, b, NULL,
+	    adblocksaved, NULL);
+	g_bytes_unref(b);
 }
 
+/*
+ * Match an adblock pattern against the lowercased url s. '*' matches
+ * anything, '^' a separator or the end of the url, a leading '|' anchors
+ * at the start of the url, '||' at the start of a domain label of the
+ * host h..he and a trailing '|' at the end of the url.
+ */
 static gboolean
-decidepolicy(WebKitWebView *v, WebKitPolicyDecision *d,
-    WebKitPolicyDecisionType dt, struct _client *c) {
-	WebKitNavigationAction *na;
-	WebKitResponsePolicyDecision *rd;
-	guint button, mods;
-	union _arg arg;
-
-	switch (dt) {
-	case WEBKIT_POLICY_DECISION_TYPE_NAVIGATION_ACTION:
-		na = webkit_navigation_policy_decision_get_navigation_action(
-		    WEBKIT_NAVIGATION_POLICY_DECISION(d));
-
-		if (webkit_navigation_action_is_user_gesture(na)
-		    && webkit_navigation_action_get_navigation_type(na)
-		    == WEBKIT_NAVIGATION_TYPE_LINK_CLICKED) {
-			button = webkit_navigation_action_get_mouse_button(na);
-			mods = webkit_navigation_action_get_modifiers(na);
-			if (button == 2 || (button == 1 && mods & CLEANMASK(MODKEY))) {
-				arg.v = webkit_uri_request_get_uri(
-				    webkit_navigation_action_get_request(na));
-				newwindow(c, &arg, false);
-				webkit_policy_decision_ignore(d);
+adblockmatch(const char *s, const char *h, const char *he, const char *pat) {
+	const char *p, *t, *star, *back;
+	bool anchored, domain, lit;
+
+	domain = pat[0] == '|' && pat[1] == '|';
+	anchored = !domain && pat[0] == '|';
+	pat += domain ? 2 : anchored ? 1 : 0;
+
+	/* most patterns without a token are plain strings */
+	if (!domain && !anchored && !pat[strcspn(pat, "*^|")])
+		return strstr(s, pat) != NULL;
+
+	/* only the first character of the pattern can start a match */
+	lit = !anchored && !strchr("*^|", *pat);
+
+	for (; *s; s++) {
+		if (lit && (s = strchr(s, *pat)) == NULL)
+			break;
+		if (domain && (s < h || s >= he || (s > h && s[-1] != '.')))
+			continue;
+
+		star = back = NULL;
+		for (t = s, p = pat;;) {
+			if (*p == '*') {
+				star = ++p;
+				back = t;
+				continue;
+			}
+			if (*p == '\0')
+				return TRUE;
+			if (*p == '|' && p[1] == '\0' && *t == '\0')
+				return TRUE;
+			if (*p == '^' && *t == '\0') {
+				p++;
+				continue;
 			}
+			if (*t != '\0' && (*p == *t || (*p == '^'
+			    && !g_ascii_isalnum(*t) && !strchr("_-.%", *t)))) {
+				p++;
+				t++;
+				continue;
+			}
+			if (star == NULL || *back == '\0')
+				break;
+			p = star;
+			t = ++back;
 		}
-		break;
-	case WEBKIT_POLICY_DECISION_TYPE_NEW_WINDOW_ACTION:
-		na = webkit_navigation_policy_decision_get_navigation_action(
-		    WEBKIT_NAVIGATION_POLICY_DECISION(d));
+		if (anchored)
+			break;
+	}
 
-		if (webkit_navigation_action_is_user_gesture(na)
-		    && webkit_navigation_action_get_navigation_type(na)
-		    == WEBKIT_NAVIGATION_TYPE_LINK_CLICKED) {
-			arg.v = webkit_uri_request_get_uri(
-			    webkit_navigation_action_get_request(na));
-			newwindow(c, &arg, false);
-		}
-		webkit_policy_decision_ignore(d);
-		break;
-	case WEBKIT_POLICY_DECISION_TYPE_RESPONSE:
-		rd = WEBKIT_RESPONSE_POLICY_DECISION(d);
-		if (!webkit_response_policy_decision_is_mime_type_supported(rd)) {
-			arg.v = webkit_uri_request_get_uri(
-			    webkit_response_policy_decision_get_request(rd));
-			initdownload(c, &arg);
-			webkit_policy_decision_ignore(d);
-		}
-		break;
-	default:
-		return FALSE;
+	return FALSE;
+}
+
+/* Map bin if it was compiled from the list described by st. */
+static const struct _blockhdr *
+adblockopen(const char *bin, const struct stat *st) {
+	const struct _blockhdr *h;
+	struct stat bst;
+	void *map;
+	int fd;
+
+	if ((fd = open(bin, O_RDONLY)) < 0)
+		return NULL;
+	map = NULL;
+	if (fstat(fd, &bst) == 0 && bst.st_size > sizeof(*h)) {
+		map = mmap(NULL, bst.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+			map = NULL;
+	}
+	close(fd);
+
+	h = map;
+	if (h && (memcmp(h->magic, BLOCKMAGIC, sizeof(h->magic))
+	    || h->mtime != st->st_mtim.tv_sec
+	    || h->mtimensec != st->st_mtim.tv_nsec
+	    || h->size != st->st_size || h->hosts == 0 || h->tokens == 0
+	    || sizeof(*h) + ((guint64)h->hosts + h->rules + h->patterns)
+	    * sizeof(guint32) + (guint64)h->tokens * sizeof(struct _blocktok)
+	    >= bst.st_size || ((char *)map)[bst.st_size - 1] != '\0')) {
+		munmap(map, bst.st_size);
+		return NULL;
 	}
 
-	return TRUE;
+	return h;
 }
 
+/* remove the rules compiled from older lists */
 static void
-destroyclient(struct _client *c) {
-	struct _client *p;
+adblockpruned(GObject *o, GAsyncResult *r, gpointer unused) {
+	gchar **ids;
+	guint i;
 
-	webkit_web_view_stop_loading(c->view);
-	gtk_widget_destroy(GTK_WIDGET(c->view));
-	gtk_widget_destroy(c->win);
+	ids = webkit_user_content_filter_store_fetch_identifiers_finish(
+	    filterstore, r);
+	for (i = 0; ids && ids[i]; i++)
+		if (strcmp(ids[i], filterid))
+			webkit_user_content_filter_store_remove(filterstore,
+			    ids[i], NULL, NULL, NULL);
+	g_strfreev(ids);
+}
 
-	for (p = clients; p && p->next != c; p = p->next)
-		;
-	if (p)
-		p->next = c->next;
-	else
-		clients = c->next;
+static void
+adblockrule(char *l, GHashTable *hosts, GHashTable *tokens,
+    GPtrArray *patterns) {
+	static const char *loopback[] = {
+		"localhost", "localhost.localdomain", "local", "broadcasthost",
+		"ip6-localhost", "ip6-loopback", "ip6-localnet",
+		"ip6-mcastprefix", "ip6-allnodes", "ip6-allrouters",
+		"ip6-allhosts",
+	};
+	char *p, *tok, *e, *save;
+	guint best, bestlen, i;
+	GPtrArray *a;
+
+	l = g_strstrip(l);
+
+	/* comments, element hiding, exceptions and rules with options */
+	if (!*l || *l == '!' || *l == '[' || *l == '#' || strchr(l, '$')
+	    || strstr(l, "@@") || strstr(l, "##") || strstr(l, "#@#")
+	    || strstr(l, "#?#"))
+		return;
 
-	free(c);
+	for (p = l; *p; p++)
+		*p = g_ascii_tolower(*p);
+
+	/*
+	 * hosts(5) style entries, an address and its names. The names the
+	 * file gives to loopback and to addresses stay reachable.
+	 */
+	e = l + strspn(l, "0123456789abcdef.:");
+	if (e > l && (*e == ' ' || *e == '\t')) {
+		e[strcspn(e, "#")] = '\0';
+		for (p = strtok_r(e, " \t", &save); p;
+		    p = strtok_r(NULL, " \t", &save)) {
+			if (strchr(p, ':') || !p[strspn(p, "0123456789.")])
+				continue;
+			for (i = 0; i < LENGTH(loopback); i++)
+				if (!strcmp(p, loopback[i]))
+					break;
+			if (i == LENGTH(loopback))
+				g_hash_table_add(hosts, p);
+		}
+		return;
+	}
 
-	if (clients == NULL)
-		gtk_main_quit();
+	/* a match may start and end anywhere, outer '*' only cost time */
+	l += strspn(l, "*");
+	for (p = l + strlen(l); p > l && p[-1] == '*'; p--)
+		p[-1] = '\0';
+	if (!*l)
+		return;
+
+	/* ||example.com^ */
+	if (l[0] == '|' && l[1] == '|') {
+		p = l + 2;
+		e = p + strspn(p, "abcdefghijklmnopqrstuvwxyz0123456789-.");
+		if (e > p && (*e == '\0' || (strchr("^/", *e) && e[1] == '\0'))) {
+			*e = '\0';
+			g_hash_table_add(hosts, p);
+			return;
+		}
+	}
+
+	/*
+	 * Index the pattern by its longest token that is delimited on both
+	 * sides, so it is a whole alphanumeric run in every matching url.
+	 */
+	best = bestlen = 0;
+	for (p = l; *p; p = e) {
+		for (; *p && !g_ascii_isalnum(*p); p++)
+			;
+		for (e = p; g_ascii_isalnum(*e); e++)
+			;
+		tok = p;
+		if (e == tok || e - tok <= bestlen)
+			continue;
+		if (tok == l || tok[-1] == '*')
+			continue;
+		if (*e == '\0' || *e == '*')
+			continue;
+		best = adblockhash(tok, e);
+		bestlen = e - tok;
+	}
+
+	if (bestlen == 0) {
+		g_ptr_array_add(patterns, l);
+		return;
+	}
+	if ((a = g_hash_table_lookup(tokens, GUINT_TO_POINTER(best)))
+	    == NULL) {
+		a = g_ptr_array_new();
+		g_hash_table_insert(tokens, GUINT_TO_POINTER(best), a);
+	}
+	g_ptr_array_add(a, l);
 }
 
-static void
-destroywin(GtkWidget *w, struct _client *c) {
-	destroyclient(c);
+/* The compiled list as a JSON array of WebKit content rules. */
+static GBytes *
+adblockrules(void) {
+	const guint32 *hosts, *rules;
+	const char *strs;
+	GString *s;
+	guint32 i;
+
+	hosts = (const guint32 *)(blockmap + 1);
+	rules = (const guint32 *)((const struct _blocktok *)(hosts
+	    + blockmap->hosts) + blockmap->tokens);
+	strs = (const char *)(rules + blockmap->rules + blockmap->patterns);
+
+	s = g_string_new("[");
+	for (i = 0; i < blockmap->hosts; i++)
+		if (hosts[i])
+			adblockjson(s, strs + hosts[i], TRUE);
+	/* the patterns follow the token rules */
+	for (i = 0; i < blockmap->rules + blockmap->patterns; i++)
+		adblockjson(s, strs + rules[i], FALSE);
+	if (s->len == 1) {
+		g_string_free(s, TRUE);
+		return NULL;
+	}
+	s->str[s->len - 1] = ']';
+
+	return g_string_free_to_bytes(s);
 }
 
 static void
-die(const char *errstr, ...) {
-	va_list ap;
-
-	va_start(ap, errstr);
-	vfprintf(stderr, errstr, ap);
-	va_end(ap);
+adblocksaved(GObject *o, GAsyncResult *r, gpointer unused) {
+	WebKitUserContentFilter *f;
+	GError *err = NULL;
+
+	f = webkit_user_content_filter_store_save_finish(filterstore, r, &err);
+	if (f == NULL) {
+		fprintf(stderr, "surf: adblock: %s\n", err->message);
+		g_error_free(err);
+		return;
+	}
+	webkit_user_content_manager_add_filter(contentmanager, f);
+	webkit_user_content_filter_unref(f);
 
-	exit(EXIT_FAILURE);
+	webkit_user_content_filter_store_fetch_identifiers(filterstore, NULL,
+	    adblockpruned, NULL);
 }
 
 static void
-find(struct _client *c, const union _arg *arg) {
-	const char *s;
+addaccelgroup(struct _client *c) {
+	int i;
+	GtkAccelGroup *group;
+	GClosure *closure;
 
-	s = getatom(c, ATOMFIND);
-	gboolean forward = arg->b;
+	group = gtk_accel_group_new();
 
-	if (g_strcmp0(webkit_find_controller_get_search_text(c->finder), s))
-		webkit_find_controller_search(c->finder, s, findopts, G_MAXUINT);
-	else {
-		if (forward)
-			webkit_find_controller_search_next(c->finder);
-		else
-			webkit_find_controller_search_previous(c->finder);
+	for (i = 0; i < LENGTH(keys); i++) {
+		closure = g_cclosure_new(G_CALLBACK(keypress), c, NULL);
+		gtk_accel_group_connect(group, keys[i].keyval, keys[i].mod,
+		    0, closure);
 	}
+	gtk_window_add_accel_group(GTK_WINDOW(c->win), group);
 }
 
-static const char *
-getatom(struct _client *c, enum _atom a) {
-	static char buf[BUFSIZ];
-	Atom adummy;
-	int idummy;
-	unsigned long ldummy;
-	unsigned char *p = NULL;
+/*
+ * WebKit pushes changes of the content manager to all pages, there is no
+ * need to reload them.
+ */
+static void
+applystyles(void) {
+	guint i;
 
-	XGetWindowProperty(dpy, c->xwin, atoms[a], 0L, BUFSIZ,
-	    False, XA_STRING, &adummy, &idummy, &ldummy, &ldummy, &p);
+	webkit_user_content_manager_remove_all_style_sheets(contentmanager);
+	for (i = 0; i < sitestyles->len; i++)
+		webkit_user_content_manager_add_style_sheet(contentmanager,
+		    g_ptr_array_index(sitestyles, i));
+	if (styled && userstyle)
+		webkit_user_content_manager_add_style_sheet(contentmanager,
+		    userstyle);
+}
+
+/* Put c->view into the window, see newview() and prerenderswap(). */
+static void
+attachview(struct _client *c) {
+	gtk_container_add(GTK_CONTAINER(c->win), GTK_WIDGET(c->view));
+
+	g_signal_connect(c->view, "notify::estimated-load-progress",
+	    G_CALLBACK(loadprogressed), c);
+	g_signal_connect(c->view, "notify::title",
+	    G_CALLBACK(titlechanged), c);
+	g_signal_connect(c->view, "create",
+	    G_CALLBACK(createwindow), c);
+	g_signal_connect(c->view, "decide-policy",
+	    G_CALLBACK(decidepolicy), c);
+	g_signal_connect(c->view, "insecure-content-detected",
+	    G_CALLBACK(insecurecontent), c);
+	g_signal_connect(c->view, "load-changed",
+	    G_CALLBACK(loadchanged), c);
+	g_signal_connect(c->view, "load-failed",
+	    G_CALLBACK(loadfailed), c);
+	g_signal_connect(c->view, "mouse-target-changed",
+	    G_CALLBACK(mousetargetchanged), c);
+	g_signal_connect(c->view, "permission-request",
+	    G_CALLBACK(permissionrequest), c);
+	g_signal_connect(c->view, "ready-to-show",
+	    G_CALLBACK(show), c);
+	g_signal_connect(c->view, "resource-load-started",
+	    G_CALLBACK(resourceloadstarted), c);
+
+	c->finder = webkit_web_view_get_find_controller(c->view);
+	g_signal_connect(c->finder, "found-text",
+	    G_CALLBACK(findfound), c);
+	g_signal_connect(c->finder, "failed-to-find",
+	    G_CALLBACK(findfailed), c);
+}
+
+/*
+ * Batch mode renders every uri of batchfile into outdir/NNNN.png, .pdf and
+ * .txt, NNNN being its line number, with batchworkers views in parallel.
+ * The views live in offscreen windows and share the context.
+ */
+static gboolean
+batch(void) {
+	struct _batch *b;
+	WebKitSettings *settings;
+	gchar *buf;
+	GError *err = NULL;
+	guint i;
+
+	if (!g_file_get_contents(batchfile, &buf, NULL, &err))
+		die("surf: cannot read %s: %s\n", batchfile, err->message);
+	batchuris = g_strsplit(buf, "\n", -1);
+	g_free(buf);
+
+	/* absolute for the file: uri of the pdf */
+	if (outdir == NULL)
+		outdir = g_get_current_dir();
+	else if (!g_path_is_absolute(outdir))
+		outdir = g_build_filename(g_get_current_dir(), outdir, NULL);
+	g_mkdir_with_parents(outdir, 0755);
+
+	/* looked up by what it is, its name is translated */
+	gtk_enumerate_printers(batchfileprinter, NULL, NULL, TRUE);
+	if (batchprinter == NULL)
+		fprintf(stderr, "surf: no printer for files, writing no pdf\n");
+
+	batchstarted = g_get_monotonic_time();
+	for (i = 0; i < MAX(batchworkers, 1); i++) {
+		b = calloc(1, sizeof(struct _batch));
+		if (b == NULL)
+			die("batch(): cannot malloc.\n");
+
+		b->win = gtk_offscreen_window_new();
+		settings = newsettings();
+		b->view = WEBKIT_WEB_VIEW(g_object_new(WEBKIT_TYPE_WEB_VIEW,
+		    "web-context", context,
+		    "settings", settings,
+		    "user-content-manager", contentmanager, NULL));
+		g_object_unref(settings);
+		gtk_widget_set_size_request(GTK_WIDGET(b->view), 1024, 768);
+		gtk_container_add(GTK_CONTAINER(b->win), GTK_WIDGET(b->view));
+		gtk_widget_show_all(b->win);
+
+		g_signal_connect(b->view, "load-changed",
+		    G_CALLBACK(batchloaded), b);
+		g_signal_connect(b->view, "load-failed",
+		    G_CALLBACK(batchloadfailed), b);
+
+		b->next = batches;
+		batches = b;
+		batchstart(b);
+	}
+
+	for (b = batches; b && b->uri == NULL; b = b->next)
+		;
+
+	return b != NULL;
+}
+
+/*
+ * One line per uri on stdout: status, line, seconds to commit, to finish
+ * loading and until all files are written, uri.
+ */
+/* The batch of an output, NULL once its uri was given up on. */
+static struct _batch *
+batchcurrent(struct _batchout *o) {
+	return o->gen == o->b->gen ? o->b : NULL;
+}
+
+static void
+batchdone(struct _batch *b) {
+	struct _batch *p;
+	struct rusage ru;
+	gint64 now;
+
+	if (b->timeout) {
+		g_source_remove(b->timeout);
+		b->timeout = 0;
+	}
+	if (b->error)
+		batcherrors++;
+	else
+		batchok++;
+	now = g_get_monotonic_time();
+	printf("%s %u %.3f %.3f %.3f %s%s%s\n", b->error ? "fail" : "ok",
+	    b->n, b->committed ? (b->committed - b->started) / 1e6 : -1.0,
+	    b->finished ? (b->finished - b->started) / 1e6 : -1.0,
+	    (now - b->started) / 1e6, b->uri,
+	    b->error ? " " : "", b->error ? b->error : "");
+	fflush(stdout);
+	g_free(b->error);
+	b->error = NULL;
+
+	batchstart(b);
+	if (b->uri)
+		return;
+
+	/* out of uris, the last view to finish ends the run */
+	for (p = batches; p && p->uri == NULL; p = p->next)
+		;
+	if (p == NULL) {
+		getrusage(RUSAGE_SELF, &ru);
+		fprintf(stderr, "surf: %u ok, %u failed in %.2fs, "
+		    "peak rss %ld KiB\n", batchok, batcherrors,
+		    (now - batchstarted) / 1e6, ru.ru_maxrss);
+		gtk_main_quit();
+	}
+}
+
+static gboolean
+batchexpired(gpointer p) {
+	struct _batch *b;
+
+	b = p;
+	b->timeout = 0;
+	if (b->error == NULL)
+		b->error = g_strdup("timeout");
+	if (b->pending == 0) {
+		/* load-failed and FINISHED follow and call batchdone() */
+		webkit_web_view_stop_loading(b->view);
+		return FALSE;
+	}
+
+	/* a snapshot, text or pdf never came, the late ones are dropped */
+	b->pending = 0;
+	b->gen++;
+	batchdone(b);
+
+	return FALSE;
+}
+
+/* The file backend's printer is the one virtual printer that takes pdf. */
+static gboolean
+batchfileprinter(GtkPrinter *p, gpointer data) {
+	if (!gtk_printer_is_virtual(p) || !gtk_printer_accepts_pdf(p))
+		return FALSE;
+	batchprinter = g_strdup(gtk_printer_get_name(p));
+
+	return TRUE;
+}
+
+static void
+batchloaded(WebKitWebView *v, WebKitLoadEvent e, struct _batch *b) {
+	struct _batchout *o;
+	gchar *path, *uri;
+	GtkPrintSettings *ps;
+	WebKitPrintOperation *op;
+
+	if (b->uri == NULL)
+		return;
+	if (e == WEBKIT_LOAD_COMMITTED)
+		b->committed = g_get_monotonic_time();
+	if (e != WEBKIT_LOAD_FINISHED)
+		return;
+	b->finished = g_get_monotonic_time();
+	/* the timeout stays for the outputs, batchdone() removes it */
+	if (b->error) {
+		batchdone(b);
+		return;
+	}
+
+	b->pending = batchprinter ? 3 : 2;
+
+	webkit_web_view_get_snapshot(v, WEBKIT_SNAPSHOT_REGION_FULL_DOCUMENT,
+	    WEBKIT_SNAPSHOT_OPTIONS_NONE, NULL, batchsnapshot, batchout(b));
+
+	webkit_web_view_run_javascript(v,
+	    "document.body ? document.body.innerText : ''", NULL,
+	    batchtext, batchout(b));
+
+	if (batchprinter == NULL)
+		return;
+
+	/* the operation print() shows the dialog for, sent to a file */
+	path = g_strdup_printf("%s/%04u.pdf", outdir, b->n);
+	uri = g_filename_to_uri(path, NULL, NULL);
+	ps = gtk_print_settings_new();
+	gtk_print_settings_set_printer(ps, batchprinter);
+	gtk_print_settings_set(ps, GTK_PRINT_SETTINGS_OUTPUT_FILE_FORMAT,
+	    "pdf");
+	gtk_print_settings_set(ps, GTK_PRINT_SETTINGS_OUTPUT_URI, uri);
+	op = webkit_print_operation_new(v);
+	webkit_print_operation_set_print_settings(op, ps);
+	o = batchout(b);
+	g_signal_connect(op, "failed", G_CALLBACK(batchprintfailed), o);
+	g_signal_connect(op, "finished", G_CALLBACK(batchprinted), o);
+	webkit_print_operation_print(op);
+	g_object_unref(ps);
+	g_free(uri);
+	g_free(path);
+}
+
+static gboolean
+batchloadfailed(WebKitWebView *v, WebKitLoadEvent e, gchar *uri,
+    GError *err, struct _batch *b) {
+	if (b->error == NULL)
+		b->error = g_strdup(err->message);
+
+	return TRUE;
+}
+
+/* Called once per output, the last one finishes the uri. */
+static void
+batchnextfile(struct _batchout *o) {
+	struct _batch *b;
+
+	b = batchcurrent(o);
+	g_free(o);
+	if (b && --b->pending == 0)
+		batchdone(b);
+}
+
+static struct _batchout *
+batchout(struct _batch *b) {
+	struct _batchout *o;
+
+	o = g_new(struct _batchout, 1);
+	o->b = b;
+	o->gen = b->gen;
+
+	return o;
+}
+
+static void
+batchprinted(WebKitPrintOperation *op, struct _batchout *o) {
+	g_object_unref(op);
+	batchnextfile(o);
+}
+
+static void
+batchprintfailed(WebKitPrintOperation *op, GError *err, struct _batchout *o) {
+	struct _batch *b;
+
+	if ((b = batchcurrent(o)) && b->error == NULL)
+		b->error = g_strdup_printf("pdf: %s", err->message);
+}
+
+static void
+batchsnapshot(GObject *o, GAsyncResult *r, gpointer p) {
+	struct _batch *b;
+	cairo_surface_t *s;
+	GError *err = NULL;
+	gchar *path;
+
+	b = batchcurrent(p);
+	s = webkit_web_view_get_snapshot_finish(WEBKIT_WEB_VIEW(o), r, &err);
+	if (s && b) {
+		path = g_strdup_printf("%s/%04u.png", outdir, b->n);
+		if (cairo_surface_write_to_png(s, path) != CAIRO_STATUS_SUCCESS
+		    && b->error == NULL)
+			b->error = g_strdup_printf("cannot write %s", path);
+		g_free(path);
+	} else if (s == NULL) {
+		if (b && b->error == NULL)
+			b->error = g_strdup_printf("png: %s", err->message);
+		g_error_free(err);
+	}
+	if (s)
+		cairo_surface_destroy(s);
+	batchnextfile(p);
+}
+
+/* Skips empty lines and # comments. */
+static void
+batchstart(struct _batch *b) {
+	gchar *uri;
+
+	b->uri = NULL;
+	while (batchuris[batchnext]) {
+		uri = g_strstrip(batchuris[batchnext++]);
+		if (*uri && *uri != '#') {
+			b->uri = uri;
+			b->n = batchnext;
+			break;
+		}
+	}
+	if (b->uri == NULL)
+		return;
+
+	b->started = g_get_monotonic_time();
+	b->committed = b->finished = 0;
+	b->pending = 0;
+	if (batchtimeout)
+		b->timeout = g_timeout_add_seconds(batchtimeout, batchexpired,
+		    b);
+	webkit_web_view_load_uri(b->view, b->uri);
+}
+
+static void
+batchtext(GObject *o, GAsyncResult *r, gpointer p) {
+	struct _batch *b;
+	WebKitJavascriptResult *js;
+	GError *err = NULL;
+	gchar *path, *text;
+
+	b = batchcurrent(p);
+	js = webkit_web_view_run_javascript_finish(WEBKIT_WEB_VIEW(o), r, &err);
+	if (js && b) {
+		text = jsc_value_to_string(
+		    webkit_javascript_result_get_js_value(js));
+		path = g_strdup_printf("%s/%04u.txt", outdir, b->n);
+		if (!g_file_set_contents(path, text, -1, NULL)
+		    && b->error == NULL)
+			b->error = g_strdup_printf("cannot write %s", path);
+		g_free(path);
+		g_free(text);
+	} else if (js == NULL) {
+		if (b && b->error == NULL)
+			b->error = g_strdup_printf("txt: %s", err->message);
+		g_error_free(err);
+	}
+	if (js)
+		webkit_javascript_result_unref(js);
+	batchnextfile(p);
+}
+
+/*
+ * Make path absolute and create the directories leading to it. Below
+ * ~/.surf, which belongs to surf2, the directory is made private and
+ * the file is created; a path elsewhere, like -c /tmp/jar, is left to
+ * the user.
+ */
+static char *
+buildpath(const char *path) {
+	char *apath, *own, *p;
+	gboolean owned;
+	FILE *f;
+
+	apath = abspath(path);
+	own = g_build_filename(g_get_home_dir(), ".surf", NULL);
+	owned = g_str_has_prefix(apath, own)
+	    && (apath[strlen(own)] == '/' || apath[strlen(own)] == '\0');
+	g_free(own);
+
+	/* creating directory */
+	p = strrchr(apath, '/');
+	if (p != NULL && p > apath) {
+		*p = '\0';
+		g_mkdir_with_parents(apath, 0700);
+		if (owned)
+			g_chmod(apath, 0700); /* in case it existed */
+		*p = '/';
+	}
+	if (!owned)
+		return apath;
+
+	/* creating file (gives error when apath ends with "/") */
+	f = fopen(apath, "a");
+	if (f != NULL) {
+		g_chmod(apath, 0600); /* always */
+		fclose(f);
+	}
+
+	return apath;
+}
+
+static void
+cachefetched(GObject *o, GAsyncResult *r, gpointer unused) {
+	WebKitWebsiteDataManager *dm;
+	GList *sites, *drop, *l;
+	guint64 total, size;
+
+	dm = WEBKIT_WEBSITE_DATA_MANAGER(o);
+	sites = webkit_website_data_manager_fetch_finish(dm, r, NULL);
+
+	total = 0;
+	for (l = sites; l; l = l->next)
+		total += webkit_website_data_get_size(l->data,
+		    WEBKIT_WEBSITE_DATA_DISK_CACHE);
+
+	sites = g_list_sort(sites, cmpsitesize);
+	drop = NULL;
+	for (l = sites; l && total > (guint64)cachelimit << 20; l = l->next) {
+		size = webkit_website_data_get_size(l->data,
+		    WEBKIT_WEBSITE_DATA_DISK_CACHE);
+		total -= size;
+		drop = g_list_prepend(drop, l->data);
+	}
+	if (drop)
+		webkit_website_data_manager_remove(dm,
+		    WEBKIT_WEBSITE_DATA_DISK_CACHE, drop, NULL, NULL, NULL);
+
+	g_list_free(drop);
+	g_list_free_full(sites, (GDestroyNotify)webkit_website_data_unref);
+}
+
+/*
+ * WebKit sizes its disk cache by the cache model only. To keep cachedir
+ * under cachelimit the caches of the largest sites are dropped first.
+ */
+static gboolean
+cachetrim(gpointer unused) {
+	webkit_website_data_manager_fetch(
+	    webkit_web_context_get_website_data_manager(context),
+	    WEBKIT_WEBSITE_DATA_DISK_CACHE, NULL, cachefetched, NULL);
+
+	return TRUE;
+}
+
+static void
+cleanup(void) {
+	struct _client *c;
+
+	if (ctlpath)
+		unlink(ctlpath);
+	if (poolfiller)
+		g_source_remove(poolfiller);
+	while ((c = pool) != NULL) {
+		pool = c->next;
+		g_signal_handlers_disconnect_by_func(c->win,
+		    G_CALLBACK(destroywin), c);
+		if (c->titleidle)
+			g_source_remove(c->titleidle);
+		gtk_widget_destroy(c->win);
+		free(c);
+	}
+
+	while (clients)
+		destroyclient(clients);
+}
+
+static void
+clipboard(struct _client *c, const union _arg *arg) {
+	gboolean paste;
+	GtkClipboard *clipboard;
+
+	paste = arg->b;
+	clipboard = gtk_clipboard_get(GDK_SELECTION_PRIMARY);
+
+	if (paste) {
+		gtk_clipboard_request_text(clipboard, pasteuri, c);
+	} else {
+		gtk_clipboard_set_text(clipboard, c->hoveruri
+			? c->hoveruri : c->uri, -1);
+	}
+}
+
+/* highest score first */
+static gint
+cmphist(gconstpointer a, gconstpointer b) {
+	gdouble x, y;
+
+	x = (*(struct _histrec * const *)a)->score;
+	y = (*(struct _histrec * const *)b)->score;
+
+	return x < y ? 1 : -(x > y);
+}
+
+static gint
+cmpint64(gconstpointer a, gconstpointer b) {
+	gint64 x, y;
+
+	x = *(const gint64 *)a;
+	y = *(const gint64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* largest first */
+static gint
+cmpsitesize(gconstpointer a, gconstpointer b) {
+	guint64 x, y;
+
+	x = webkit_website_data_get_size((WebKitWebsiteData *)a,
+	    WEBKIT_WEBSITE_DATA_DISK_CACHE);
+	y = webkit_website_data_get_size((WebKitWebsiteData *)b,
+	    WEBKIT_WEBSITE_DATA_DISK_CACHE);
+
+	return x < y ? 1 : -(x > y);
+}
+
+/* also sorts struct _histtri, which starts with its trigram */
+static gint
+cmptrigram(gconstpointer a, gconstpointer b) {
+	guint32 x, y;
+
+	x = *(const guint32 *)a;
+	y = *(const guint32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static gchar *
+copystr(char **dst, const char *src) {
+	gchar *tmp;
+
+	tmp = g_strdup(src);
+	if (dst && *dst) {
+		g_free(*dst);
+		*dst = tmp;
+	}
+
+	return tmp;
+}
+
+static WebKitWebView *
+createwindow(WebKitWebView *v, struct _client *c) {
+	struct _client *n;
+
+	n = newclient(embed, false);
+
+	return n->view;
+}
+
+static gboolean
+ctlaccept(GIOChannel *ch, GIOCondition cond, gpointer unused) {
+	struct _ctl *ctl;
+	int fd;
+
+	if ((fd = accept(ctlfd, NULL, NULL)) < 0)
+		return TRUE;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	ctl = g_new0(struct _ctl, 1);
+	ctl->fd = fd;
+	ctl->in = g_string_new(NULL);
+	ctl->out = g_string_new(NULL);
+	ctl->ch = g_io_channel_unix_new(fd);
+	ctl->cond = G_IO_IN | G_IO_HUP | G_IO_ERR;
+	g_io_add_watch(ctl->ch, ctl->cond, ctlio, ctl);
+
+	return TRUE;
+}
+
+/* Run one command against a single client, answer "ok" or "error". */
+static gboolean
+ctlclient(GString *out, struct _client *c, const char *cmd, char *args) {
+	union _arg arg;
+	gchar *path;
+	guint key;
+	GdkModifierType mods;
+
+	if (!strcmp(cmd, "go") || !strcmp(cmd, "find"))
+		wake(c);
+
+	if (!strcmp(cmd, "go") && *args) {
+		arg.v = args;
+		loaduri(c, &arg);
+	} else if (!strcmp(cmd, "find") && *args) {
+		c->findtext = copystr(&c->findtext, args);
+		arg.b = TRUE;
+		find(c, &arg);
+	} else if (!strcmp(cmd, "key")) {
+		gtk_accelerator_parse(args, &key, &mods);
+		if (!key || !keypress(NULL, NULL, key, mods, c)) {
+			g_string_append_printf(out, "error no binding for %s\n",
+			    args);
+			return FALSE;
+		}
+	} else if (!strcmp(cmd, "state")) {
+		ctlstate(out, c);
+		g_string_append_c(out, '\n');
+		return TRUE;
+	} else if (!strcmp(cmd, "metrics")) {
+		ctlmetrics(out, c);
+		g_string_append_c(out, '\n');
+		return TRUE;
+	} else if (!strcmp(cmd, "har")) {
+		if ((path = harwrite(c)) == NULL) {
+			g_string_append(out, "error cannot write har\n");
+			return FALSE;
+		}
+		g_string_append_printf(out, "ok %s\n", path);
+		g_free(path);
+		return TRUE;
+	} else {
+		g_string_append_printf(out, "error bad command %s\n", cmd);
+		return FALSE;
+	}
+	g_string_append(out, "ok\n");
+
+	return TRUE;
+}
+
+/*
+ * One command per line, answered by exactly one line, so commands can be
+ * batched and pipelined:
+ *
+ *   open <uri>            open uri in a new window, answers "ok <id>"
+ *   go <id> <uri>         load uri in window id
+ *   find <id> <text>      search for text in window id
+ *   key <id> <accel>      run the binding for accel, e.g. <Control>j
+ *   state [<id>]          state of all or one window as JSON
+ *   downloads             running and queued downloads as JSON
+ *   complete <query>      history matching query as JSON, see -H
+ *   all <command> [args]  run go, find or key in every window
+ *
+ * Window ids are the xids as printed by -x and used by _SURF_*.
+ */
+static void
+ctlcommand(GString *out, char *line) {
+	struct _client *c, *n;
+	struct _download *dl;
+	union _arg arg;
+	GArray *pids;
+	GString *reply;
+	char *cmd, *args, *sub;
+	Window id;
+	pid_t pid;
+	guint i, ok;
+
+	cmd = line;
+	if ((args = strchr(line, ' ')) != NULL)
+		*args++ = '\0';
+	else
+		args = "";
+
+	if (!strcmp(cmd, "open")) {
+		arg.v = *args ? args : NULL;
+		if (!inprocesswindows) {
+			arg.v = args;
+			newwindow(NULL, &arg, false);
+			g_string_append(out, "ok\n");
+			return;
+		}
+		n = getclient(embed);
+		show(NULL, n);
+		if (arg.v)
+			loaduri(n, &arg);
+		else
+			updatetitle(n);
+		g_string_append_printf(out, "ok %lu\n", n->xwin);
+	} else if (!strcmp(cmd, "all")) {
+		sub = args;
+		if ((args = strchr(sub, ' ')) != NULL)
+			*args++ = '\0';
+		else
+			args = "";
+		if (!strcmp(sub, "state") || !strcmp(sub, "metrics")) {
+			g_string_append_printf(out, "error bad command %s\n",
+			    sub);
+			return;
+		}
+		/* only the count is answered */
+		reply = g_string_new(NULL);
+		for (ok = 0, c = clients; c; c = c->next) {
+			g_string_truncate(reply, 0);
+			ok += ctlclient(reply, c, sub, args);
+		}
+		g_string_free(reply, TRUE);
+		g_string_append_printf(out, "ok %u\n", ok);
+	} else if (!strcmp(cmd, "downloads")) {
+		g_string_append_c(out, '[');
+		for (dl = downloads; dl; dl = dl->next) {
+			g_string_append(out, "{\"uri\":");
+			jsonstr(out, dl->uri);
+			g_string_append(out, ",\"dest\":");
+			jsonstr(out, dl->dest);
+			g_string_append_printf(out, ",\"received\":%"
+			    G_GUINT64_FORMAT ",\"total\":%" G_GUINT64_FORMAT
+			    ",\"state\":\"%s\"}%s", dl->received, dl->total,
+			    dl->state == DLQUEUED ? "queued" : "active",
+			    dl->next ? "," : "");
+		}
+		g_string_append(out, "]\n");
+	} else if (!strcmp(cmd, "complete")) {
+		histcomplete(out, args, TRUE);
+		g_string_append_c(out, '\n');
+	} else if (!strcmp(cmd, "metrics") && !*args) {
+		ctlmetrics(out, NULL);
+		g_string_append_c(out, '\n');
+	} else if (!strcmp(cmd, "state") && !*args) {
+		g_string_append(out, "{\"clients\":[");
+		for (c = clients; c; c = c->next) {
+			ctlstate(out, c);
+			if (c->next)
+				g_string_append_c(out, ',');
+		}
+		g_string_append(out, "],\"webprocesses\":[");
+		pids = g_array_new(FALSE, FALSE, sizeof(pid_t));
+		webprocs(pids);
+		for (i = 0; i < pids->len; i++) {
+			pid = g_array_index(pids, pid_t, i);
+			for (ok = 0, c = clients; c; c = c->next)
+				ok += c->view && c->webpid == pid;
+			if (i)
+				g_string_append_c(out, ',');
+			ctlproc(out, pid, ok);
+		}
+		g_array_free(pids, TRUE);
+		g_string_append_printf(out, "],\"pool\":{\"hits\":%u,"
+		    "\"misses\":%u}}\n", poolhits, poolmisses);
+	} else {
+		id = strtoul(args, &args, 0);
+		args += strspn(args, " ");
+		for (c = clients; c && c->xwin != id; c = c->next)
+			;
+		if (c == NULL)
+			g_string_append_printf(out, "error no window %lu\n", id);
+		else
+			ctlclient(out, c, cmd, args);
+	}
+}
+
+static gboolean
+ctlio(GIOChannel *ch, GIOCondition cond, gpointer p) {
+	struct _ctl *ctl;
+	char buf[BUFSIZ], *l, *e;
+	ssize_t n;
+	GIOCondition want;
+
+	ctl = p;
+
+	if (cond & G_IO_IN && !ctl->eof) {
+		n = read(ctl->fd, buf, sizeof(buf));
+		if (n < 0 && errno != EAGAIN && errno != EINTR)
+			goto close;
+		if (n > 0)
+			g_string_append_len(ctl->in, buf, n);
+		/* the client is done asking, a last line needs no newline */
+		if (n == 0) {
+			ctl->eof = TRUE;
+			g_string_append_c(ctl->in, '\n');
+		}
+
+		for (l = ctl->in->str; (e = strchr(l, '\n')) != NULL; l = e + 1) {
+			*e = '\0';
+			if (e > l && e[-1] == '\r')
+				e[-1] = '\0';
+			if (*l)
+				ctlcommand(ctl->out, l);
+		}
+		g_string_erase(ctl->in, 0, l - ctl->in->str);
+		if (ctl->in->len > CTLLINE) {
+			g_string_append(ctl->out, "error line too long\n");
+			g_string_truncate(ctl->in, 0);
+			ctl->eof = TRUE;
+		}
+	} else if (cond & (G_IO_HUP | G_IO_ERR)) {
+		goto close;
+	}
+
+	if (ctl->out->len > 0) {
+		/* a client that went away must not take surf with SIGPIPE */
+		n = send(ctl->fd, ctl->out->str, ctl->out->len, MSG_NOSIGNAL);
+		if (n < 0 && errno != EAGAIN && errno != EINTR)
+			goto close;
+		if (n > 0)
+			g_string_erase(ctl->out, 0, n);
+	}
+	/* closed once the answers to everything read are sent */
+	if (ctl->eof && ctl->out->len == 0)
+		goto close;
+
+	/* only wait for writability while there are pending answers */
+	want = G_IO_HUP | G_IO_ERR;
+	if (!ctl->eof)
+		want |= G_IO_IN;
+	if (ctl->out->len > 0)
+		want |= G_IO_OUT;
+	if (want != ctl->cond) {
+		ctl->cond = want;
+		g_io_add_watch(ch, want, ctlio, ctl);
+		return FALSE;
+	}
+
+	return TRUE;
+
+close:
+	g_io_channel_unref(ctl->ch);
+	close(ctl->fd);
+	g_string_free(ctl->in, TRUE);
+	g_string_free(ctl->out, TRUE);
+	g_free(ctl);
+
+	return FALSE;
+}
+
+static void
+ctllisten(void) {
+	struct sockaddr_un sa;
+	char *dir, name[32];
+	GIOChannel *ch;
+
+	dir = buildpath(socketdir);
+	snprintf(name, sizeof(name), "surf2-%d.sock", getpid());
+	ctlpath = g_build_filename(dir, name, NULL);
+	g_free(dir);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (strlcpy(sa.sun_path, ctlpath, sizeof(sa.sun_path))
+	    >= sizeof(sa.sun_path)
+	    || (ctlfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		fprintf(stderr, "surf: cannot create control socket %s\n",
+		    ctlpath);
+		return;
+	}
+	fcntl(ctlfd, F_SETFD, FD_CLOEXEC);
+	unlink(ctlpath);
+	if (bind(ctlfd, (struct sockaddr *)&sa, sizeof(sa)) < 0
+	    || listen(ctlfd, 16) < 0) {
+		perror("surf: control socket");
+		close(ctlfd);
+		ctlfd = -1;
+		return;
+	}
+	chmod(ctlpath, 0600);
+	g_setenv("SURF_SOCKET", ctlpath, TRUE);
+
+	ch = g_io_channel_unix_new(ctlfd);
+	g_io_add_watch(ch, G_IO_IN, ctlaccept, NULL);
+	g_io_channel_unref(ch);
+}
+
+/* Percentiles over the navigations kept of c, of all windows if c is NULL. */
+static void
+ctlmetrics(GString *out, struct _client *c) {
+	struct _client *p;
+	struct _nav *nav;
+	GArray *commit, *finish;
+	gint64 t;
+	guint i, fast, slow;
+
+	commit = g_array_new(FALSE, FALSE, sizeof(gint64));
+	finish = g_array_new(FALSE, FALSE, sizeof(gint64));
+	fast = slow = 0;
+	for (p = c ? c : clients; p; p = c ? NULL : p->next) {
+		for (i = 0; i < MIN(p->navcount, NAVRING); i++) {
+			nav = &p->navs[i];
+			if (nav->committed) {
+				t = nav->committed - nav->started;
+				g_array_append_val(commit, t);
+			}
+			t = nav->finished - nav->started;
+			g_array_append_val(finish, t);
+			fast += nav->fastresponses;
+			slow += nav->slowresponses;
+		}
+	}
+
+	g_string_append_printf(out, "{\"navigations\":%u,\"commit_ms\":",
+	    finish->len);
+	ctlpercentiles(out, commit);
+	g_string_append(out, ",\"finish_ms\":");
+	ctlpercentiles(out, finish);
+	g_string_append_printf(out, ",\"responses\":{\"fast\":%u,"
+	    "\"slow\":%u}", fast, slow);
+	/* prerendering is counted for all windows */
+	g_string_append_printf(out, ",\"prerender\":{\"hits\":%u,"
+	    "\"misses\":%u,\"hit_rate\":%.2f,\"saved_ms\":%.1f}}",
+	    prerenderhits, prerendermisses,
+	    prerenderhits + prerendermisses ? (gdouble)prerenderhits
+	    / (prerenderhits + prerendermisses) : 0.0,
+	    prerendersaved / 1e3);
+
+	g_array_free(commit, TRUE);
+	g_array_free(finish, TRUE);
+}
+
+/* Nearest rank, sorts v. */
+static void
+ctlpercentiles(GString *out, GArray *v) {
+	if (v->len == 0) {
+		g_string_append(out, "null");
+		return;
+	}
+
+	g_array_sort(v, cmpint64);
+	g_string_append_printf(out, "{\"p50\":%.1f,\"p95\":%.1f}",
+	    g_array_index(v, gint64, (v->len * 50 + 99) / 100 - 1) / 1e3,
+	    g_array_index(v, gint64, (v->len * 95 + 99) / 100 - 1) / 1e3);
+}
+
+static void
+ctlproc(GString *out, pid_t pid, guint windows) {
+	guint64 rss;
+	gdouble cpu;
+
+	if (pid == 0 || !webprocstat(pid, &rss, &cpu)) {
+		g_string_append(out, "null");
+		return;
+	}
+	g_string_append_printf(out, "{\"pid\":%d,\"rss_kb\":%" G_GUINT64_FORMAT
+	    ",\"cpu_s\":%.2f", (int)pid, rss, cpu);
+	if (windows)
+		g_string_append_printf(out, ",\"windows\":%u", windows);
+	g_string_append_c(out, '}');
+}
+
+static void
+ctlstate(GString *out, struct _client *c) {
+	g_string_append_printf(out, "{\"id\":%lu,\"uri\":", c->xwin);
+	jsonstr(out, c->uri);
+	g_string_append(out, ",\"title\":");
+	jsonstr(out, c->title);
+	g_string_append_printf(out, ",\"progress\":%d,\"ssl\":%s,"
+	    "\"discarded\":%s,\"webprocess\":",
+	    c->progress, c->ssl ? (c->sslfailed ? "\"failed\"" : "true")
+	    : "false", c->view ? "false" : "true");
+	ctlproc(out, c->view ? c->webpid : 0, 0);
+	g_string_append_c(out, '}');
+}
+
+static gboolean
+decidedestination(WebKitDownload *d, gchar *name, struct _download *dl) {
+	gchar *base, *file, *path;
+	guint i;
+
+	base = g_path_get_basename(name && *name ? name : "download");
+	file = g_build_filename(downloaddir, base, NULL);
+	path = g_strdup(file);
+	for (i = 1; g_file_test(path, G_FILE_TEST_EXISTS); i++) {
+		g_free(path);
+		path = g_strdup_printf("%s.%u", file, i);
+	}
+	g_free(base);
+	g_free(file);
+
+	g_free(dl->dest);
+	dl->dest = g_filename_to_uri(path, NULL, NULL);
+	webkit_download_set_destination(d, dl->dest);
+	g_free(path);
+
+	return TRUE;
+}
+
+static gboolean
+decidepolicy(WebKitWebView *v, WebKitPolicyDecision *d,
+    WebKitPolicyDecisionType dt, struct _client *c) {
+	WebKitNavigationAction *na;
+	WebKitResponsePolicyDecision *rd;
+	guint button, mods;
+	union _arg arg;
+
+	switch (dt) {
+	case WEBKIT_POLICY_DECISION_TYPE_NAVIGATION_ACTION:
+		na = webkit_navigation_policy_decision_get_navigation_action(
+		    WEBKIT_NAVIGATION_POLICY_DECISION(d));
+
+		if (webkit_navigation_action_is_user_gesture(na)
+		    && webkit_navigation_action_get_navigation_type(na)
+		    == WEBKIT_NAVIGATION_TYPE_LINK_CLICKED) {
+			button = webkit_navigation_action_get_mouse_button(na);
+			mods = webkit_navigation_action_get_modifiers(na);
+			arg.v = webkit_uri_request_get_uri(
+			    webkit_navigation_action_get_request(na));
+			if (button == 2 || (button == 1 && mods & CLEANMASK(MODKEY))) {
+				newwindow(c, &arg, false);
+				webkit_policy_decision_ignore(d);
+				break;
+			}
+			if (c->prerender
+			    && !g_strcmp0(arg.v, c->prerenderuri)) {
+				webkit_policy_decision_ignore(d);
+				prerenderswap(c);
+				break;
+			}
+		}
+		break;
+	case WEBKIT_POLICY_DECISION_TYPE_NEW_WINDOW_ACTION:
+		na = webkit_navigation_policy_decision_get_navigation_action(
+		    WEBKIT_NAVIGATION_POLICY_DECISION(d));
+
+		if (webkit_navigation_action_is_user_gesture(na)
+		    && webkit_navigation_action_get_navigation_type(na)
+		    == WEBKIT_NAVIGATION_TYPE_LINK_CLICKED) {
+			arg.v = webkit_uri_request_get_uri(
+			    webkit_navigation_action_get_request(na));
+			newwindow(c, &arg, false);
+		}
+		webkit_policy_decision_ignore(d);
+		break;
+	case WEBKIT_POLICY_DECISION_TYPE_RESPONSE:
+		rd = WEBKIT_RESPONSE_POLICY_DECISION(d);
+		if (webkit_response_policy_decision_is_mime_type_supported(rd))
+			break;
+		/* nothing is downloaded on a hover, the click will */
+		if (v != c->view) {
+			webkit_policy_decision_ignore(d);
+			g_free(c->prerenderuri);
+			c->prerenderuri = NULL;
+			if (c->prerenderidle == 0)
+				c->prerenderidle = g_idle_add(prerenderstale,
+				    c);
+			break;
+		}
+		webkit_policy_decision_download(d);
+		break;
+	default:
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Work the first page does not wait for, done once it committed, or
+ * deferdelay ms after the start if nothing commits.
+ */
+static gboolean
+deferinit(gpointer unused) {
+	struct _client *c;
+	int i;
+
+	if (deferred)
+		return FALSE;
+	deferred = TRUE;
+	if (defertimer) {
+		g_source_remove(defertimer);
+		defertimer = 0;
+	}
+
+	/* newclient() adds them itself from now on */
+	for (i = 0; i < 2; i++)
+		for (c = i ? pool : clients; c; c = c->next)
+			addaccelgroup(c);
+
+	watchstyles();
+
+	/* background windows */
+	if (discardafter)
+		g_timeout_add_seconds(MIN(discardafter, 60), discardtick, NULL);
+	g_signal_connect(g_memory_monitor_dup_default(), "low-memory-warning",
+	    G_CALLBACK(lowmemory), NULL);
+
+	if (cachelimit) {
+		cachetrim(NULL);
+		g_timeout_add_seconds(600, cachetrim, NULL);
+	}
+
+	trace("deferred");
+
+	return FALSE;
+}
+
+static void
+destroyclient(struct _client *c) {
+	struct _client *p;
+
+	if (clients == c && c->next == NULL && sessionidle) {
+		g_source_remove(sessionidle);
+		savesession(NULL);
+	}
+
+	if (c->titleidle) {
+		g_source_remove(c->titleidle);
+		c->titleidle = 0;
+	}
+	if (c->prefetchtimer)
+		g_source_remove(c->prefetchtimer);
+	if (c->findtimer)
+		g_source_remove(c->findtimer);
+	prerenderdrop(c);
+	if (c->view) {
+		webkit_web_view_stop_loading(c->view);
+		gtk_widget_destroy(GTK_WIDGET(c->view));
+	}
+	gtk_widget_destroy(c->win);
+	if (c->session)
+		webkit_web_view_session_state_unref(c->session);
+	if (c->sessionrecord)
+		g_bytes_unref(c->sessionrecord);
+	g_free(c->sessionuri);
+	g_object_unref(c->settings);
+	g_ptr_array_free(c->har, TRUE);
+	g_ptr_array_free(c->prerenderhar, TRUE);
+
+	for (p = clients; p && p->next != c; p = p->next)
+		;
+	if (p)
+		p->next = c->next;
+	else
+		clients = c->next;
+
+	free(c);
+
+	/* the last window is kept in the session for -R */
+	if (clients)
+		sessionchanged(NULL);
+
+	/* keep running until the downloads of the last window are done */
+	if (clients == NULL && downloads == NULL)
+		gtk_main_quit();
+}
+
+static void
+destroywin(GtkWidget *w, struct _client *c) {
+	destroyclient(c);
+}
+
+static void
+die(const char *errstr, ...) {
+	va_list ap;
+
+	va_start(ap, errstr);
+	vfprintf(stderr, errstr, ap);
+	va_end(ap);
+
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * The scroll position is not part of the session state of the current
+ * page, so it is asked for first and the view is dropped in discarded().
+ */
+static void
+discard(struct _client *c) {
+	if (c->view == NULL || c->discarding)
+		return;
+
+	c->discarding = TRUE;
+	webkit_web_view_run_javascript(c->view,
+	    "window.scrollX + ',' + window.scrollY", NULL, discarded, NULL);
+}
+
+/* Drop the views of all windows nobody looked at for idle microseconds. */
+static void
+discardall(gint64 idle) {
+	struct _client *c;
+	struct _download *dl;
+	gint64 now;
+
+	now = g_get_monotonic_time();
+	for (c = clients; c; c = c->next) {
+		if (c->view == NULL)
+			continue;
+		if (gtk_window_is_active(GTK_WINDOW(c->win))) {
+			c->lastseen = now;
+			continue;
+		}
+		if (now - c->lastseen < idle || c->inspecting
+		    || webkit_web_view_is_loading(c->view)
+		    || webkit_web_view_is_playing_audio(c->view))
+			continue;
+		for (dl = downloads; dl && dl->view != c->view; dl = dl->next)
+			;
+		if (dl == NULL)
+			discard(c);
+	}
+}
+
+static void
+discarded(GObject *o, GAsyncResult *r, gpointer unused) {
+	struct _client *c;
+	WebKitJavascriptResult *js;
+	gchar *pos, *uri;
+
+	js = webkit_web_view_run_javascript_finish(WEBKIT_WEB_VIEW(o), r, NULL);
+
+	/* closed or woken up again in the meantime */
+	for (c = clients; c && c->view != WEBKIT_WEB_VIEW(o); c = c->next)
+		;
+	if (c == NULL || !c->discarding) {
+		if (js)
+			webkit_javascript_result_unref(js);
+		return;
+	}
+
+	c->pagex = c->pagey = 0;
+	if (js) {
+		pos = jsc_value_to_string(
+		    webkit_javascript_result_get_js_value(js));
+		sscanf(pos, "%d,%d", &c->pagex, &c->pagey);
+		g_free(pos);
+		webkit_javascript_result_unref(js);
+	}
+
+	c->session = webkit_web_view_get_session_state(c->view);
+	c->zoom = webkit_web_view_get_zoom_level(c->view);
+	/* c->uri belongs to the view */
+	uri = g_strdup(c->uri);
+	g_free(c->sessionuri);
+	c->uri = c->sessionuri = uri;
+
+	c->discarding = FALSE;
+	c->scrolling = FALSE;
+	c->scrollx = c->scrolly = 0;
+	c->progress = 100;
+	c->finder = NULL;
+	c->inspector = NULL;
+	g_ptr_array_set_size(c->har, 0);
+	prerenderdrop(c);
+	gtk_widget_destroy(GTK_WIDGET(c->view));
+	c->view = NULL;
+	updatetitle(c);
+}
+
+static gboolean
+discardtick(gpointer unused) {
+	discardall(discardafter * G_USEC_PER_SEC);
+
+	return TRUE;
+}
+
+static void
+downloadfailed(WebKitDownload *d, GError *err, struct _download *dl) {
+	if (g_error_matches(err, WEBKIT_DOWNLOAD_ERROR,
+	    WEBKIT_DOWNLOAD_ERROR_NETWORK) && dl->retries < downloadretries) {
+		dl->retries++;
+		dl->state = DLRETRY;
+		return;
+	}
+
+	fprintf(stderr, "surf: download of %s failed: %s\n", dl->uri,
+	    err->message);
+	dl->state = DLDONE;
+}
+
+static void
+downloadfinished(WebKitDownload *d, struct _download *dl) {
+	struct _download **p;
+	struct _client *c;
+
+	g_signal_handlers_disconnect_by_data(d, dl);
+	g_object_unref(d);
+	dl->download = NULL;
+
+	for (c = clients; c; c = c->next)
+		if (c->view == dl->view)
+			updatetitle(c);
+
+	if (dl->state == DLRETRY) {
+		/* start over; WebKitDownload cannot resume partial files */
+		dl->state = DLQUEUED;
+		dl->received = 0;
+		downloadnext();
+		return;
+	}
+
+	for (p = &downloads; *p != dl; p = &(*p)->next)
+		;
+	*p = dl->next;
+	g_free(dl->uri);
+	g_free(dl->dest);
+	g_free(dl);
+
+	downloadnext();
+
+	if (clients == NULL && downloads == NULL)
+		gtk_main_quit();
+}
+
+/*
+ * Start queued downloads while there are free slots. A restart is a new
+ * GET of dl->uri: the POST body, Referer and HTTP authentication of the
+ * request that began the download are not sent again. It goes through
+ * the view that began it while that is open, so the download stays
+ * attached to the window.
+ */
+static void
+downloadnext(void) {
+	struct _download *dl;
+	struct _client *c;
+	guint active;
+
+	for (active = 0, dl = downloads; dl; dl = dl->next)
+		if (dl->state != DLQUEUED)
+			active++;
+
+	for (dl = downloads; dl; dl = dl->next) {
+		if (maxdownloads && active >= maxdownloads)
+			break;
+		if (dl->state != DLQUEUED)
+			continue;
+		active++;
+		for (c = clients; c && c->view != dl->view; c = c->next)
+			;
+		if (c) {
+			downloadwatch(dl, webkit_web_view_download_uri(c->view,
+			    dl->uri));
+		} else {
+			/* a later view may be allocated at the same address */
+			dl->view = NULL;
+			downloadwatch(dl, webkit_web_context_download_uri(
+			    context, dl->uri));
+		}
+	}
+}
+
+static void
+downloadprogress(WebKitDownload *d, guint64 len, struct _download *dl) {
+	WebKitURIResponse *res;
+	struct _client *c;
+
+	dl->received += len;
+	if ((res = webkit_download_get_response(d)) != NULL)
+		dl->total = webkit_uri_response_get_content_length(res);
+
+	for (c = clients; c; c = c->next)
+		if (c->view == dl->view)
+			updatetitle(c);
+}
+
+static void
+downloadstarted(WebKitWebContext *ctx, WebKitDownload *d, gpointer unused) {
+	struct _download *dl, **p;
+	guint active;
+
+	/* restarted by downloadnext(), already watched */
+	for (active = 0, dl = downloads; dl; dl = dl->next) {
+		if (dl->download == d)
+			return;
+		if (dl->state != DLQUEUED)
+			active++;
+	}
+
+	dl = g_new0(struct _download, 1);
+	dl->uri = g_strdup(webkit_uri_request_get_uri(
+	    webkit_download_get_request(d)));
+	dl->view = webkit_download_get_web_view(d);
+	for (p = &downloads; *p; p = &(*p)->next)
+		;
+	*p = dl;
+
+	if (maxdownloads && active >= maxdownloads) {
+		/* restarted by downloadnext() when a slot is free */
+		dl->state = DLQUEUED;
+		webkit_download_cancel(d);
+		return;
+	}
+
+	downloadwatch(dl, g_object_ref(d));
+}
+
+static void
+downloadwatch(struct _download *dl, WebKitDownload *d) {
+	dl->state = DLACTIVE;
+	dl->received = dl->total = 0;
+	dl->download = d;
+	g_signal_connect(d, "decide-destination",
+	    G_CALLBACK(decidedestination), dl);
+	g_signal_connect(d, "received-data",
+	    G_CALLBACK(downloadprogress), dl);
+	g_signal_connect(d, "failed", G_CALLBACK(downloadfailed), dl);
+	g_signal_connect(d, "finished", G_CALLBACK(downloadfinished), dl);
+}
+
+static gboolean
+dropview(gpointer v) {
+	gtk_widget_destroy(GTK_WIDGET(v));
+	g_object_unref(v);
+
+	return FALSE;
+}
+
+/* Tell about windows that could not be opened in a new process. */
+static void
+exited(gint status, gint64 usec, gpointer unused) {
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+		return;
+	fprintf(stderr, "surf: window process %s %d after %.1fs\n",
+	    WIFEXITED(status) ? "exited with" : "killed by signal",
+	    WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status),
+	    usec / 1e6);
+}
+
+static gboolean
+fillpool(gpointer unused) {
+	struct _client *c;
+	guint n;
+
+	for (n = 0, c = pool; c; c = c->next)
+		n++;
+	if (n >= poolsize) {
+		poolfiller = 0;
+		return FALSE;
+	}
+
+	/* newclient() links it into clients, the pool keeps it hidden */
+	c = newclient(0, false);
+	clients = c->next;
+	c->next = pool;
+	pool = c;
+	c->pooled = TRUE;
+
+	/* start its web process now instead of on the first real load */
+	webkit_web_view_load_uri(c->view, "about:blank");
+
+	return TRUE;
+}
+
+static void
+find(struct _client *c, const union _arg *arg) {
+	const char *s;
+	gboolean forward;
+
+	s = c->findtext ? c->findtext : "";
+	forward = arg->b;
+
+	if (g_strcmp0(webkit_find_controller_get_search_text(c->finder), s)) {
+		/* ends the last search, one scan finds and counts */
+		webkit_find_controller_search_finish(c->finder);
+		c->findcounted = FALSE;
+		if (*s)
+			webkit_find_controller_search(c->finder, s, findopts,
+			    findcap);
+		updatetitle(c);
+	} else {
+		if (forward)
+			webkit_find_controller_search_next(c->finder);
+		else
+			webkit_find_controller_search_previous(c->finder);
+	}
+}
+
+static void
+findfailed(WebKitFindController *f, struct _client *c) {
+	findfound(f, 0, c);
+}
+
+static gboolean
+findflush(gpointer p) {
+	struct _client *c;
+	union _arg arg;
+
+	c = p;
+	c->findtimer = 0;
+	arg.b = TRUE;
+	find(c, &arg);
+
+	return FALSE;
+}
+
+/* More than findcap matches are reported as G_MAXUINT. */
+static void
+findfound(WebKitFindController *f, guint n, struct _client *c) {
+	c->findmatches = MIN(n, findcap);
+	c->findcounted = TRUE;
+	updatetitle(c);
+}
+
+/*
+ * Edit c->findtext while findstart() is active. The search runs finddelay
+ * ms after the last key, so typing a word costs one search, not one per
+ * letter.
+ */
+static gboolean
+findkeypress(GtkWidget *w, GdkEventKey *e, struct _client *c) {
+	gchar buf[8], *s, *t;
+	gunichar u;
+
+	if (!c->finding || e->state & GDK_CONTROL_MASK)
+		return FALSE;
+
+	s = c->findtext ? c->findtext : "";
+	switch (e->keyval) {
+	case GDK_KEY_Escape:
+		c->finding = FALSE;
+		c->findcounted = FALSE;
+		c->findtext = copystr(&c->findtext, NULL);
+		if (c->findtimer) {
+			g_source_remove(c->findtimer);
+			c->findtimer = 0;
+		}
+		webkit_find_controller_search_finish(c->finder);
+		updatetitle(c);
+		return TRUE;
+	case GDK_KEY_Return:
+	case GDK_KEY_KP_Enter:
+		c->finding = FALSE;
+		if (c->findtimer) {
+			g_source_remove(c->findtimer);
+			findflush(c);
+		}
+		updatetitle(c);
+		return TRUE;
+	case GDK_KEY_BackSpace:
+		if (*s == '\0')
+			return TRUE;
+		t = g_utf8_find_prev_char(s, s + strlen(s));
+		*t = '\0';
+		break;
+	default:
+		u = gdk_keyval_to_unicode(e->keyval);
+		if (!g_unichar_isprint(u))
+			return FALSE;
+		buf[g_unichar_to_utf8(u, buf)] = '\0';
+		t = g_strconcat(s, buf, NULL);
+		g_free(c->findtext);
+		c->findtext = t;
+		break;
+	}
+
+	if (c->findtimer)
+		g_source_remove(c->findtimer);
+	c->findtimer = g_timeout_add(finddelay, findflush, c);
+	updatetitle(c);
+
+	return TRUE;
+}
+
+static void
+findstart(struct _client *c, const union _arg *arg) {
+	c->finding = TRUE;
+	c->findtext = copystr(&c->findtext, NULL);
+	updatetitle(c);
+}
+
+static gboolean
+flushtitle(gpointer p) {
+	struct _client *c;
+	char t[sizeof(c->titlebuf)], progress[32], found[256];
+	const char *title;
+	struct _download *dl;
+	guint64 received, total;
+	guint n;
+
+	c = p;
+	c->titleidle = 0;
+	title = c->title ? c->title : "";
+
+	if (showindicators) {
+		getpagestats(c);
+
+		for (n = 0, received = total = 0, dl = downloads; dl;
+		    dl = dl->next) {
+			if (dl->view != c->view)
+				continue;
+			n++;
+			received += dl->received;
+			total += dl->total;
+		}
+
+		if (c->progress < 100)
+			snprintf(progress, sizeof(progress), "[%i%%] ",
+			    c->progress);
+		else
+			progress[0] = '\0';
+		if (n && total)
+			snprintf(progress + strlen(progress), sizeof(progress)
+			    - strlen(progress), "[dl %u %d%%] ", n,
+			    (int)(received * 100 / total));
+		else if (n)
+			snprintf(progress + strlen(progress), sizeof(progress)
+			    - strlen(progress), "[dl %u] ", n);
+
+		/* the count stops at findcap */
+		found[0] = '\0';
+		if (c->findcounted)
+			snprintf(found, sizeof(found), "[%u%s] ",
+			    c->findmatches,
+			    c->findmatches >= findcap ? "+" : "");
+		if (c->finding)
+			snprintf(found + strlen(found), sizeof(found)
+			    - strlen(found), "/%s ",
+			    c->findtext ? c->findtext : "");
+		utf8cut(found);
+
+		if (c->hoveruri)
+			snprintf(t, sizeof(t), "%s%s%s:%s > %s%s%s%s%s%s%s",
+			    progress, found, c->togglestats, pagestats,
+			    c->hoveruri,
+			    c->hovertitle ? " [" : "",
+			    c->hovertitle ? c->hovertitle : "",
+			    c->hovertitle ? "]" : "",
+			    c->hovercontent ? " <" : "",
+			    c->hovercontent ? c->hovercontent : "",
+			    c->hovercontent ? ">" : "");
+		else
+			snprintf(t, sizeof(t), "%s%s%s:%s | %s%s%s%s",
+			    progress, found, c->togglestats, pagestats, title,
+			    c->hovercontent ? " <" : "",
+			    c->hovercontent ? c->hovercontent : "",
+			    c->hovercontent ? ">" : "");
+	} else
+		strlcpy(t, title, sizeof(t));
+	utf8cut(t);
+
+	/* unchanged titles are not sent to the window manager again */
+	if (strcmp(t, c->titlebuf)) {
+		memcpy(c->titlebuf, t, sizeof(t));
+		gtk_window_set_title(GTK_WINDOW(c->win), c->titlebuf);
+	}
+
+	return FALSE;
+}
+
+static const char *
+getatom(struct _client *c, enum _atom a) {
+	static char buf[BUFSIZ];
+	Atom adummy;
+	int idummy;
+	unsigned long ldummy;
+	unsigned char *p = NULL;
+
+	XGetWindowProperty(dpy, c->xwin, atoms[a], 0L, BUFSIZ,
+	    False, XA_STRING, &adummy, &idummy, &ldummy, &ldummy, &p);
 	if (p)
 		strlcpy(buf, (char *)p, LENGTH(buf));
 	else
@@ -358,6 +2775,38 @@ getatom(struct _client *c, enum _atom a) {
 	return buf;
 }
 
+/*
+ * Hand out a ready hidden client from the pool if there is one. Embedded
+ * windows have to be plugged into their socket at creation time, so they
+ * are always built fresh.
+ */
+static struct _client *
+getclient(Window e) {
+	struct _client *c;
+
+	if (e || poolsize == 0)
+		return newclient(e, false);
+
+	if ((c = pool) != NULL) {
+		pool = c->next;
+		c->next = clients;
+		clients = c;
+		c->pooled = FALSE;
+		c->lastseen = g_get_monotonic_time();
+		poolhits++;
+	} else {
+		c = newclient(0, false);
+		poolmisses++;
+	}
+
+	if (!poolfiller)
+		poolfiller = g_idle_add_full(G_PRIORITY_LOW, fillpool,
+		    NULL, NULL);
+	updatepoolstats();
+
+	return c;
+}
+
 static WebKitCookieAcceptPolicy
 getcookiepolicy(void) {
 	WebKitCookieAcceptPolicy policy;
@@ -388,48 +2837,583 @@ getpagestats(struct _client *c) {
 	pagestats[2] = '\0';
 }
 
+/* Only called when a toggle changes, titles use the cached c->togglestats. */
 static void
 gettogglestats(struct _client *c) {
 	gboolean enabled;
 	int p;
 	WebKitSettings *settings;
 
-	settings = webkit_web_view_get_settings(c->view);
+	settings = c->settings;
 	p = 0;
 
-	togglestats[p++] = setcookiepolicy(getcookiepolicy());
+	c->togglestats[p++] = setcookiepolicy(getcookiepolicy());
 
 	enabled = webkit_settings_get_enable_caret_browsing(settings);
-	togglestats[p++] = enabled ? 'C' : 'c';
+	c->togglestats[p++] = enabled ? 'C' : 'c';
 
-	togglestats[p++] = allowgeolocation ? 'G': 'g';
+	c->togglestats[p++] = allowgeolocation ? 'G': 'g';
 
 	enabled = webkit_settings_get_auto_load_images(settings);
-	togglestats[p++] = enabled ? 'I' : 'i';
+	c->togglestats[p++] = enabled ? 'I' : 'i';
 
 	enabled = webkit_settings_get_enable_javascript(settings);
-	togglestats[p++] = enabled ? 'S' : 's';
+	c->togglestats[p++] = enabled ? 'S' : 's';
 
 	enabled = webkit_settings_get_enable_plugins(settings);
-	togglestats[p++] = enabled ? 'V' : 'v';
+	c->togglestats[p++] = enabled ? 'V' : 'v';
 
-	togglestats[p++] = c->styled ? 'M': 'm';
+	c->togglestats[p++] = styled ? 'M': 'm';
 
-	togglestats[p] = '\0';
+	c->togglestats[p] = '\0';
 }
 
-static gboolean
-initdownload(struct _client *c, const union _arg *a) {
-	union _arg arg;
+/* ISO 8601 in UTC with milliseconds, t from g_get_real_time() */
+static void
+hardate(char *buf, size_t len, gint64 t) {
+	time_t sec;
+	struct tm tm;
+	size_t n;
+
+	sec = t / G_USEC_PER_SEC;
+	gmtime_r(&sec, &tm);
+	n = strftime(buf, len, "%Y-%m-%dT%H:%M:%S", &tm);
+	snprintf(buf + n, len - n, ".%03dZ",
+	    (int)(t % G_USEC_PER_SEC / 1000));
+}
+
+static void
+harexport(struct _client *c, const union _arg *arg) {
+	g_free(harwrite(c));
+}
 
-	arg = (union _arg)DOWNLOAD((char *)a->v, (char *)c->uri);
+static void
+harfree(gpointer p) {
+	struct _har *h;
+
+	h = p;
+	if (h->res) {
+		g_signal_handlers_disconnect_by_data(h->res, h);
+		g_object_unref(h->res);
+	}
+	g_free(h->method);
+	g_free(h->uri);
+	g_free(h->mime);
+	g_free(h->error);
+	g_free(h);
+}
+
+/*
+ * Writes the resources of the current navigation as HAR 1.2 to
+ * hardir/<xid>-<time>.har and returns the path. Headers, cookies and
+ * the split of the wait time are not known to WebKit's API and left out.
+ */
+static gchar *
+harwrite(struct _client *c) {
+	struct _har *h;
+	GString *out;
+	GError *err = NULL;
+	gchar *path, date[32];
+	gint64 end;
+	guint i;
+
+	if (c->nav.date == 0)
+		return NULL;
+
+	hardate(date, sizeof(date), c->nav.date);
+
+	out = g_string_new("{\"log\":{\"version\":\"1.2\",\"creator\":"
+	    "{\"name\":\"surf2\",\"version\":\"" VERSION "\"},");
+	g_string_append_printf(out, "\"pages\":[{\"startedDateTime\":\"%s\","
+	    "\"id\":\"page_1\",\"title\":", date);
+	jsonstr(out, c->title ? c->title : c->uri);
+	g_string_append_printf(out, ",\"pageTimings\":{\"onContentLoad\":-1,"
+	    "\"onLoad\":%.1f}}],\"entries\":[", c->nav.finished ?
+	    (c->nav.finished - c->nav.started) / 1e3 : -1.0);
+
+	for (i = 0; i < c->har->len; i++) {
+		h = g_ptr_array_index(c->har, i);
+		end = h->finished ? h->finished : g_get_real_time();
+		hardate(date, sizeof(date), h->started);
+
+		g_string_append_printf(out, "%s{\"pageref\":\"page_1\","
+		    "\"startedDateTime\":\"%s\",\"time\":%.1f,"
+		    "\"request\":{\"method\":", i ? "," : "", date,
+		    (end - h->started) / 1e3);
+		jsonstr(out, h->method ? h->method : "GET");
+		g_string_append(out, ",\"url\":");
+		jsonstr(out, h->uri);
+		g_string_append_printf(out, ",\"httpVersion\":\"\","
+		    "\"cookies\":[],\"headers\":[],\"queryString\":[],"
+		    "\"headersSize\":-1,\"bodySize\":-1},"
+		    "\"response\":{\"status\":%u,\"statusText\":\"\","
+		    "\"httpVersion\":\"\",\"cookies\":[],\"headers\":[],"
+		    "\"content\":{\"size\":%" G_GUINT64_FORMAT
+		    ",\"mimeType\":", h->status, h->size);
+		jsonstr(out, h->mime ? h->mime : "");
+		g_string_append_printf(out, "},\"redirectURL\":\"\","
+		    "\"headersSize\":-1,\"bodySize\":%" G_GUINT64_FORMAT
+		    "},\"cache\":{},\"timings\":{\"send\":0,"
+		    "\"wait\":%.1f,\"receive\":%.1f}",
+		    h->size, ((h->responded ? h->responded : end)
+		    - h->started) / 1e3,
+		    h->responded ? (end - h->responded) / 1e3 : 0.0);
+		if (h->error) {
+			g_string_append(out, ",\"_error\":");
+			jsonstr(out, h->error);
+		}
+		g_string_append_c(out, '}');
+	}
+	g_string_append(out, "]}}\n");
+
+	path = g_strdup_printf("%s/%lu-%" G_GINT64_FORMAT ".har", hardir,
+	    c->xwin, c->nav.date / G_USEC_PER_SEC);
+	if (!g_file_set_contents(path, out->str, out->len, &err)) {
+		fprintf(stderr, "surf: cannot write %s: %s\n", path,
+		    err->message);
+		g_error_free(err);
+		g_free(path);
+		path = NULL;
+	}
+	g_string_free(out, TRUE);
+
+	return path;
+}
+
+/*
+ * Append the history entries that contain every word of q to out, as
+ * "uri title" lines or as a JSON array. Visits the index does not cover
+ * yet are searched in the log itself and come first.
+ */
+static void
+histcomplete(GString *out, const char *q, gboolean json) {
+	const struct _histhdr *h;
+	const struct _histent *e;
+	const struct _histtri *t, *best;
+	const guint32 *post;
+	const gchar *strs;
+	GHashTable *shown;
+	GArray *tri;
+	gchar **words;
+	guint8 *map;
+	gsize len, slen;
+	guint32 i, n, id, lo, hi, mid, tg;
+	guint found;
+
+	words = g_strsplit_set(q, " \t", -1);
+	shown = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	found = 0;
+	if (json)
+		g_string_append_c(out, '[');
+
+	/* -H answers from a stale index and its tail rather than wait */
+	map = historyfile ? histopen(&len, histquery == NULL) : NULL;
+	h = (struct _histhdr *)map;
+	histtail(out, h ? h->logsize : 0, words, shown, &found, json);
+
+	if (map) {
+		e = (struct _histent *)(h + 1);
+		t = (struct _histtri *)(e + h->entries);
+		post = (guint32 *)(t + h->trigrams);
+		strs = (gchar *)(post + h->postings);
+		slen = len - ((guint8 *)strs - map);
+
+		/* walk the shortest posting list, the others are implied */
+		tri = g_array_new(FALSE, FALSE, sizeof(guint32));
+		for (i = 0; words[i]; i++)
+			histtrigrams(tri, words[i]);
+		best = NULL;
+		for (i = 0; i < tri->len; i++) {
+			tg = g_array_index(tri, guint32, i);
+			for (lo = 0, hi = h->trigrams; lo < hi; ) {
+				mid = lo + (hi - lo) / 2;
+				if (t[mid].trigram < tg)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			if (lo == h->trigrams || t[lo].trigram != tg) {
+				best = NULL;
+				break;
+			}
+			if (best == NULL || t[lo].count < best->count)
+				best = &t[lo];
+		}
+		n = tri->len == 0 ? h->entries : best ? best->count : 0;
+		/* the index may be truncated or damaged, trust no offset */
+		if (best && (guint64)best->first + best->count > h->postings)
+			n = 0;
+
+		for (i = 0; i < n && found < histresults; i++) {
+			id = tri->len == 0 ? i : post[best->first + i];
+			if (id >= h->entries || e[id].uri >= slen
+			    || e[id].title >= slen)
+				continue;
+			if (!histmatch(strs + e[id].uri, strs + e[id].title,
+			    words) || g_hash_table_contains(shown,
+			    strs + e[id].uri))
+				continue;
+			histemit(out, strs + e[id].uri, strs + e[id].title,
+			    json, found++);
+		}
+		g_array_free(tri, TRUE);
+		munmap(map, len);
+	}
+
+	if (json)
+		g_string_append_c(out, ']');
+	g_hash_table_destroy(shown);
+	g_strfreev(words);
+}
+
+static void
+histemit(GString *out, const char *uri, const char *title, gboolean json,
+    guint n) {
+	if (json) {
+		g_string_append(out, n ? ",{\"uri\":" : "{\"uri\":");
+		jsonstr(out, uri);
+		g_string_append(out, ",\"title\":");
+		jsonstr(out, title);
+		g_string_append_c(out, '}');
+	} else if (*title) {
+		g_string_append_printf(out, "%s %s\n", uri, title);
+	} else {
+		g_string_append_printf(out, "%s\n", uri);
+	}
+}
+
+static gboolean
+histhas(const char *s, const char *w) {
+	gsize n;
 
-	updatewinid(c);
-	spawn(c, &arg);
+	n = strlen(w);
+	for (; *s; s++)
+		if (!g_ascii_strncasecmp(s, w, n))
+			return TRUE;
 
 	return FALSE;
 }
 
+/*
+ * Rebuild the index of historyfile. Entries are sorted by frecency, so the
+ * posting lists of the trigram table are in rank order too and a search
+ * can stop at the first histresults matches. Runs in its own thread, see
+ * histopen().
+ */
+static gpointer
+histindex(gpointer unused) {
+	struct _histhdr h;
+	struct _histent *ents;
+	struct _histtri t, *tp;
+	struct _histrec *r;
+	GHashTable *recs, *tris;
+	GHashTableIter it;
+	GPtrArray *sorted;
+	GArray *tab, *seen, *list;
+	GString *strs;
+	gpointer k, v;
+	gchar *buf, *line, *next, *uri, *title, *path, *tmp;
+	gsize len;
+	gint64 now;
+	guint32 i, j, n, tg;
+	FILE *f;
+
+	if (!g_file_get_contents(historyfile, &buf, &len, NULL)) {
+		g_atomic_int_set(&histindexing, 0);
+		return NULL;
+	}
+	/* a line still being written is left to the next run */
+	while (len && buf[len - 1] != '\n')
+		len--;
+
+	recs = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+	for (line = buf; line < buf + len; line = next) {
+		next = strchr(line, '\n');
+		*next++ = '\0';
+		if ((uri = strchr(line, '\t')) == NULL)
+			continue;
+		*uri++ = '\0';
+		if ((title = strchr(uri, '\t')) != NULL)
+			*title++ = '\0';
+		if ((r = g_hash_table_lookup(recs, uri)) == NULL) {
+			r = g_new0(struct _histrec, 1);
+			r->uri = uri;
+			g_hash_table_insert(recs, uri, r);
+		}
+		/* a title line names the visit before it, see histlog() */
+		if (title) {
+			r->title = title;
+		} else {
+			r->visits++;
+			r->last = MAX(r->last, g_ascii_strtoll(line, NULL, 10));
+		}
+	}
+
+	/* visits count less after a week */
+	now = g_get_real_time() / G_USEC_PER_SEC;
+	sorted = g_ptr_array_new();
+	g_hash_table_iter_init(&it, recs);
+	while (g_hash_table_iter_next(&it, NULL, &v)) {
+		r = v;
+		if (r->visits == 0)
+			continue;
+		r->score = r->visits / (1.0 + (now - r->last) / 604800.0);
+		g_ptr_array_add(sorted, r);
+	}
+	g_ptr_array_sort(sorted, cmphist);
+
+	strs = g_string_new(NULL);
+	ents = g_new(struct _histent, sorted->len);
+	tris = g_hash_table_new_full(NULL, NULL, NULL,
+	    (GDestroyNotify)g_array_unref);
+	seen = g_array_new(FALSE, FALSE, sizeof(guint32));
+	for (i = 0; i < sorted->len; i++) {
+		r = sorted->pdata[i];
+		ents[i].uri = strs->len;
+		g_string_append_len(strs, r->uri, strlen(r->uri) + 1);
+		ents[i].title = strs->len;
+		if (r->title)
+			g_string_append(strs, r->title);
+		g_string_append_c(strs, '\0');
+		ents[i].visits = r->visits;
+		ents[i].last = r->last;
+
+		g_array_set_size(seen, 0);
+		histtrigrams(seen, r->uri);
+		if (r->title)
+			histtrigrams(seen, r->title);
+		g_array_sort(seen, cmptrigram);
+		for (j = 0; j < seen->len; j++) {
+			tg = g_array_index(seen, guint32, j);
+			if (j && tg == g_array_index(seen, guint32, j - 1))
+				continue;
+			list = g_hash_table_lookup(tris, GUINT_TO_POINTER(tg));
+			if (list == NULL) {
+				list = g_array_new(FALSE, FALSE, sizeof(guint32));
+				g_hash_table_insert(tris, GUINT_TO_POINTER(tg),
+				    list);
+			}
+			g_array_append_val(list, i);
+		}
+	}
+
+	tab = g_array_new(FALSE, FALSE, sizeof(struct _histtri));
+	g_hash_table_iter_init(&it, tris);
+	while (g_hash_table_iter_next(&it, &k, &v)) {
+		t.trigram = GPOINTER_TO_UINT(k);
+		t.count = ((GArray *)v)->len;
+		g_array_append_val(tab, t);
+	}
+	g_array_sort(tab, cmptrigram);
+	for (n = 0, i = 0; i < tab->len; i++) {
+		tp = &g_array_index(tab, struct _histtri, i);
+		tp->first = n;
+		n += tp->count;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, HISTMAGIC, sizeof(h.magic));
+	h.logsize = len;
+	h.entries = sorted->len;
+	h.trigrams = tab->len;
+	h.postings = n;
+
+	/* written aside, mapped indexes keep the old file */
+	path = g_strconcat(historyfile, ".idx", NULL);
+	tmp = g_strconcat(path, ".tmp", NULL);
+	if ((f = fopen(tmp, "w")) != NULL) {
+		fwrite(&h, sizeof(h), 1, f);
+		fwrite(ents, sizeof(*ents), h.entries, f);
+		fwrite(tab->data, sizeof(t), h.trigrams, f);
+		for (i = 0; i < tab->len; i++) {
+			list = g_hash_table_lookup(tris, GUINT_TO_POINTER(
+			    g_array_index(tab, struct _histtri, i).trigram));
+			fwrite(list->data, sizeof(guint32), list->len, f);
+		}
+		fwrite(strs->str, 1, strs->len, f);
+		if (fclose(f) == 0)
+			rename(tmp, path);
+		else
+			unlink(tmp);
+	}
+
+	g_free(tmp);
+	g_free(path);
+	g_array_free(tab, TRUE);
+	g_array_free(seen, TRUE);
+	g_hash_table_destroy(tris);
+	g_free(ents);
+	g_string_free(strs, TRUE);
+	g_ptr_array_free(sorted, TRUE);
+	g_hash_table_destroy(recs);
+	g_free(buf);
+	g_atomic_int_set(&histindexing, 0);
+
+	return NULL;
+}
+
+/* A visit is a "time uri" line, its title follows as "time uri title". */
+static void
+histlog(struct _client *c, const char *title) {
+	gint64 now;
+	guint8 *map;
+	gsize len;
+	gchar *t;
+
+	if (histfp == NULL || c->uri == NULL
+	    || g_str_has_prefix(c->uri, "about:"))
+		return;
+
+	now = g_get_real_time() / G_USEC_PER_SEC;
+	if (title) {
+		t = g_strdelimit(g_strdup(title), "\t\r\n", ' ');
+		fprintf(histfp, "%" G_GINT64_FORMAT "\t%s\t%s\n", now, c->uri,
+		    t);
+		g_free(t);
+	} else {
+		fprintf(histfp, "%" G_GINT64_FORMAT "\t%s\n", now, c->uri);
+	}
+	fflush(histfp);
+
+	/* rebuilt in the background, -H never waits for it */
+	if ((guint64)ftello(histfp) > histindexed + HISTTAIL
+	    && !g_atomic_int_get(&histindexing)
+	    && (map = histopen(&len, TRUE)) != NULL)
+		munmap(map, len);
+}
+
+static gboolean
+histmatch(const char *uri, const char *title, gchar **words) {
+	for (; *words; words++)
+		if (**words && !histhas(uri, *words)
+		    && !histhas(title, *words))
+			return FALSE;
+
+	return TRUE;
+}
+
+/*
+ * Map the index read-only, so its pages are shared with every other
+ * surf2 and dropped by the kernel when memory runs low. With build, a
+ * missing index or one that lags more than HISTTAIL bytes behind the log
+ * is rebuilt in the background; the caller reads the log past it.
+ */
+static guint8 *
+histopen(gsize *len, gboolean build) {
+	struct _histhdr *h;
+	struct stat st;
+	gchar *path;
+	guint8 *map;
+	gboolean stale;
+	int fd;
+
+	path = g_strconcat(historyfile, ".idx", NULL);
+	map = NULL;
+	if ((fd = open(path, O_RDONLY)) >= 0) {
+		if (fstat(fd, &st) == 0 && st.st_size >= sizeof(*h)) {
+			*len = st.st_size;
+			map = mmap(NULL, *len, PROT_READ, MAP_SHARED, fd, 0);
+			if (map == MAP_FAILED)
+				map = NULL;
+		}
+		close(fd);
+	}
+	g_free(path);
+
+	h = (struct _histhdr *)map;
+	/* the strings are the rest of the file, the last one ends it */
+	if (map && (memcmp(h->magic, HISTMAGIC, sizeof(h->magic))
+	    || sizeof(*h) + (guint64)h->entries * sizeof(struct _histent)
+	    + (guint64)h->trigrams * sizeof(struct _histtri)
+	    + (guint64)h->postings * sizeof(guint32) > *len
+	    || (h->entries && map[*len - 1] != '\0'))) {
+		munmap(map, *len);
+		map = NULL;
+	}
+	if (map)
+		histindexed = h->logsize;
+
+	if (!build || stat(historyfile, &st))
+		return map;
+	stale = map == NULL || st.st_size < h->logsize
+	    || st.st_size - h->logsize > HISTTAIL;
+	if (stale && g_atomic_int_compare_and_exchange(&histindexing, 0, 1)) {
+		/* a failing rebuild is tried again a HISTTAIL later */
+		histindexed = st.st_size;
+		g_thread_unref(g_thread_new("histindex", histindex, NULL));
+	}
+
+	return map;
+}
+
+/* Visits after from, newest first. */
+static void
+histtail(GString *out, guint64 from, gchar **words, GHashTable *shown,
+    guint *found, gboolean json) {
+	GHashTable *titles;
+	GPtrArray *visits;
+	FILE *f;
+	char *line, *uri, *title;
+	const char *t;
+	size_t size;
+	gint i;
+
+	if (historyfile == NULL || (f = fopen(historyfile, "r")) == NULL)
+		return;
+	if (fseeko(f, from, SEEK_SET)) {
+		fclose(f);
+		return;
+	}
+
+	titles = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+	    g_free);
+	visits = g_ptr_array_new_with_free_func(g_free);
+	line = NULL;
+	size = 0;
+	while (getline(&line, &size, f) > 0) {
+		line[strcspn(line, "\n")] = '\0';
+		if ((uri = strchr(line, '\t')) == NULL)
+			continue;
+		uri++;
+		if ((title = strchr(uri, '\t')) != NULL) {
+			*title++ = '\0';
+			g_hash_table_replace(titles, g_strdup(uri),
+			    g_strdup(title));
+		} else {
+			g_ptr_array_add(visits, g_strdup(uri));
+		}
+	}
+	free(line);
+	fclose(f);
+
+	for (i = visits->len - 1; i >= 0 && *found < histresults; i--) {
+		uri = visits->pdata[i];
+		if ((t = g_hash_table_lookup(titles, uri)) == NULL)
+			t = "";
+		if (g_hash_table_contains(shown, uri)
+		    || !histmatch(uri, t, words))
+			continue;
+		histemit(out, uri, t, json, (*found)++);
+		g_hash_table_add(shown, g_strdup(uri));
+	}
+
+	g_ptr_array_free(visits, TRUE);
+	g_hash_table_destroy(titles);
+}
+
+/* Byte trigrams of s, ASCII letters folded to lower case. */
+static void
+histtrigrams(GArray *a, const char *s) {
+	guint32 t;
+
+	for (; s[0] && s[1] && s[2]; s++) {
+		t = (guint32)(guchar)g_ascii_tolower(s[0]) << 16
+		    | (guint32)(guchar)g_ascii_tolower(s[1]) << 8
+		    | (guchar)g_ascii_tolower(s[2]);
+		g_array_append_val(a, t);
+	}
+}
+
 static void
 insecurecontent(WebKitWebView *v, WebKitInsecureContentEvent e,
     struct _client *c) {
@@ -439,6 +3423,12 @@ insecurecontent(WebKitWebView *v, WebKitInsecureContentEvent e,
 
 static void
 inspector(struct _client *c, const union _arg *arg) {
+	/* created on first use, most windows never need one */
+	if (!enableinspector)
+		return;
+	if (c->inspector == NULL)
+		c->inspector = webkit_web_view_get_inspector(c->view);
+
 	if (c->inspecting) {
 		c->inspecting = FALSE;
 		webkit_web_inspector_close(WEBKIT_WEB_INSPECTOR(c->inspector));
@@ -448,6 +3438,37 @@ inspector(struct _client *c, const union _arg *arg) {
 	}
 }
 
+static void
+jsonstr(GString *out, const char *s) {
+	if (s == NULL) {
+		g_string_append(out, "null");
+		return;
+	}
+
+	g_string_append_c(out, '"');
+	for (; *s; s++) {
+		switch (*s) {
+		case '"':
+		case '\\':
+			g_string_append_c(out, '\\');
+			g_string_append_c(out, *s);
+			break;
+		case '\n':
+			g_string_append(out, "\\n");
+			break;
+		case '\t':
+			g_string_append(out, "\\t");
+			break;
+		default:
+			if ((guchar)*s < 0x20)
+				g_string_append_printf(out, "\\u%04x", *s);
+			else
+				g_string_append_c(out, *s);
+		}
+	}
+	g_string_append_c(out, '"');
+}
+
 static gboolean
 keypress(GtkAccelGroup *g, GObject *o, guint key, GdkModifierType mod,
     struct _client *c) {
@@ -463,6 +3484,7 @@ keypress(GtkAccelGroup *g, GObject *o, guint key, GdkModifierType mod,
 		    && mod == keys[i].mod
 		    && keys[i].func) {
 			updatewinid(c);
+			wake(c);
 			keys[i].func(c, &(keys[i].arg));
 			processed = TRUE;
 		}
@@ -473,17 +3495,36 @@ keypress(GtkAccelGroup *g, GObject *o, guint key, GdkModifierType mod,
 static void
 loadchanged(WebKitWebView *v, WebKitLoadEvent e, struct _client *c) {
 	GTlsCertificateFlags tlsflags;
+	gchar *script;
+
+	/* the about:blank that warms up a pooled window is no navigation */
+	if (c->pooled) {
+		if (e == WEBKIT_LOAD_COMMITTED)
+			c->webpid = webprocclaim(c, c->view);
+		return;
+	}
+
 	switch (e) {
 	case WEBKIT_LOAD_STARTED:
+		prerenderdrop(c);
+		memset(&c->nav, 0, sizeof(c->nav));
+		c->nav.date = g_get_real_time();
+		c->nav.started = g_get_monotonic_time();
+		g_ptr_array_set_size(c->har, 0);
 		c->progress = 0;
+		c->findcounted = FALSE;
 		c->committed = FALSE;
 		c->ssl = FALSE;
 		c->sslfailed = FALSE;
 		c->insecure = FALSE;
+		/* main frame only and before the request is sent */
+		siteapply(c, sitelookup(webkit_web_view_get_uri(c->view)));
 		break;
 	case WEBKIT_LOAD_REDIRECTED:
+		c->nav.redirects++;
 		break;
 	case WEBKIT_LOAD_COMMITTED:
+		c->nav.committed = g_get_monotonic_time();
 		c->committed = TRUE;
 		if (webkit_web_view_get_tls_info(c->view, NULL, &tlsflags)) {
 			c->ssl = TRUE;
@@ -491,17 +3532,214 @@ loadchanged(WebKitWebView *v, WebKitLoadEvent e, struct _client *c) {
 		}
 		c->uri = webkit_web_view_get_uri(c->view);
 		setatom(c, ATOMURI, c->uri);
+		g_free(c->sessionuri);
+		c->sessionuri = NULL;
+		c->histtitled = FALSE;
+		c->webpid = webprocclaim(c, c->view);
+		histlog(c, NULL);
+		siteapply(c, sitelookup(c->uri));
+		c->committedsite = c->site;
+		if (!deferred) {
+			trace("committed");
+			/* after the commit has been painted */
+			g_idle_add(deferinit, NULL);
+		}
 		break;
 	case WEBKIT_LOAD_FINISHED:
+		if (c->pagex || c->pagey) {
+			script = g_strdup_printf("window.scrollTo(%d, %d)",
+			    c->pagex, c->pagey);
+			webkit_web_view_run_javascript(c->view, script, NULL,
+			    NULL, NULL);
+			g_free(script);
+			c->pagex = c->pagey = 0;
+		}
+		navfinished(c);
+		sessionchanged(c);
 		updatetitle(c);
+		if (c->site && c->site->flags && strchr(c->site->flags, 'a'))
+			sitecookies(c->site);
 		break;
 	}
 }
 
+/* a load that never committed leaves the page of the committed site */
+static gboolean
+loadfailed(WebKitWebView *v, WebKitLoadEvent e, gchar *uri, GError *err,
+    struct _client *c) {
+	if (!c->pooled && !c->committed)
+		siteapply(c, c->committedsite);
+
+	return FALSE;
+}
+
+static void
+loadprogressed(WebKitWebView *v, GParamSpec *s, struct _client *c) {
+	c->progress = webkit_web_view_get_estimated_load_progress(c->view) * 100;
+	updatetitle(c);
+}
+
+/*
+ * Parse the Greasemonkey style header of a user script:
+ *
+ *   // ==UserScript==
+ *   // @include  <pattern>
+ *   // @exclude  <pattern>
+ *   // @run-at   document-start
+ *   // @noframes
+ *   // ==/UserScript==
+ *
+ * @include and @exclude take Greasemonkey globs, where '*' matches
+ * anything, @match takes match patterns. WebKit's allow and block lists
+ * understand neither, so a script with any of them is wrapped in a
+ * function that returns early on other urls, as Greasemonkey does.
+ */
+static void
+loadscript(const char *path) {
+	gchar *src, **lines, *l, *v, *js;
+	GString *include, *exclude;
+	WebKitUserScriptInjectionTime when;
+	WebKitUserContentInjectedFrames frames;
+	WebKitUserScript *script;
+	guint i;
+
+	if (!g_file_get_contents(path, &src, NULL, NULL))
+		return;
+	if (*src == '\0') {
+		g_free(src);
+		return;
+	}
+
+	include = g_string_new(NULL);
+	exclude = g_string_new(NULL);
+	when = WEBKIT_USER_SCRIPT_INJECT_AT_DOCUMENT_END;
+	frames = WEBKIT_USER_CONTENT_INJECT_ALL_FRAMES;
+
+	lines = g_strsplit(src, "\n", -1);
+	for (i = 0; lines[i]; i++) {
+		l = g_strstrip(lines[i]);
+		if (strncmp(l, "//", 2))
+			continue;
+		l += 2 + strspn(l + 2, " \t");
+		if (!strcmp(l, "==/UserScript=="))
+			break;
+		if (*l != '@')
+			continue;
+		v = l + strcspn(l, " \t");
+		if (*v)
+			*v++ = '\0';
+		v = g_strstrip(v);
+
+		if (!strcmp(l, "@include"))
+			scriptpattern(include, v, FALSE);
+		else if (!strcmp(l, "@match"))
+			scriptpattern(include, v, TRUE);
+		else if (!strcmp(l, "@exclude"))
+			scriptpattern(exclude, v, FALSE);
+		else if (!strcmp(l, "@run-at") && !strcmp(v, "document-start"))
+			when = WEBKIT_USER_SCRIPT_INJECT_AT_DOCUMENT_START;
+		else if (!strcmp(l, "@noframes"))
+			frames = WEBKIT_USER_CONTENT_INJECT_TOP_FRAME;
+	}
+	g_strfreev(lines);
+
+	if (include->len || exclude->len)
+		js = g_strdup_printf("(function () {\nif (!(%s) || %s)\n"
+		    "\treturn;\n%s\n})();\n", include->len ? include->str
+		    : "true", exclude->len ? exclude->str : "false", src);
+	else
+		js = g_strdup(src);
+	script = webkit_user_script_new(js, frames, when, NULL, NULL);
+	webkit_user_content_manager_add_script(contentmanager, script);
+	webkit_user_script_unref(script);
+
+	g_string_free(include, TRUE);
+	g_string_free(exclude, TRUE);
+	g_free(js);
+	g_free(src);
+}
+
+/* Read once per process into the content manager shared by all views. */
 static void
-loadprogressed(WebKitWebView *v, GParamSpec *s, struct _client *c) {
-	c->progress = webkit_web_view_get_estimated_load_progress(c->view) * 100;
-	updatetitle(c);
+loadscripts(void) {
+	GDir *dir;
+	GList *names, *l;
+	const gchar *name;
+	gchar *path;
+
+	scriptfile = buildpath(scriptfile);
+	loadscript(scriptfile);
+
+	scriptdir = buildpath(scriptdir);
+	if ((dir = g_dir_open(scriptdir, 0, NULL)) == NULL)
+		return;
+	names = NULL;
+	while ((name = g_dir_read_name(dir)) != NULL)
+		if (g_str_has_suffix(name, ".js"))
+			names = g_list_insert_sorted(names, g_strdup(name),
+			    (GCompareFunc)strcmp);
+	g_dir_close(dir);
+
+	for (l = names; l; l = l->next) {
+		path = g_build_filename(scriptdir, l->data, NULL);
+		loadscript(path);
+		g_free(path);
+	}
+	g_list_free_full(names, g_free);
+}
+
+/*
+ * stylefile is toggled with togglestyle(), <host>.css in styledir always
+ * applies to host and its subdomains.
+ */
+static void
+loadstyles(void) {
+	GDir *dir;
+	const gchar *name;
+	gchar *path, *css, *host, *allow[3];
+
+	if (userstyle)
+		webkit_user_style_sheet_unref(userstyle);
+	userstyle = NULL;
+	if (sitestyles)
+		g_ptr_array_free(sitestyles, TRUE);
+	sitestyles = g_ptr_array_new_with_free_func(
+	    (GDestroyNotify)webkit_user_style_sheet_unref);
+
+	if (g_file_get_contents(stylefile, &css, NULL, NULL)) {
+		userstyle = webkit_user_style_sheet_new(css,
+		    WEBKIT_USER_CONTENT_INJECT_ALL_FRAMES,
+		    WEBKIT_USER_STYLE_LEVEL_USER,
+		    stylewhitelist, styleblacklist);
+		g_free(css);
+	}
+
+	if ((dir = g_dir_open(styledir, 0, NULL)) != NULL) {
+		while ((name = g_dir_read_name(dir)) != NULL) {
+			if (!g_str_has_suffix(name, ".css"))
+				continue;
+			path = g_build_filename(styledir, name, NULL);
+			if (g_file_get_contents(path, &css, NULL, NULL)) {
+				host = g_strndup(name, strlen(name) - 4);
+				allow[0] = g_strdup_printf("*://%s/*", host);
+				allow[1] = g_strdup_printf("*://*.%s/*", host);
+				allow[2] = NULL;
+				g_ptr_array_add(sitestyles,
+				    webkit_user_style_sheet_new(css,
+				    WEBKIT_USER_CONTENT_INJECT_ALL_FRAMES,
+				    WEBKIT_USER_STYLE_LEVEL_USER,
+				    (const gchar * const *)allow, NULL));
+				g_free(allow[0]);
+				g_free(allow[1]);
+				g_free(host);
+				g_free(css);
+			}
+			g_free(path);
+		}
+		g_dir_close(dir);
+	}
+
+	applystyles();
 }
 
 static void
@@ -532,11 +3770,22 @@ loaduri(struct _client *c, const union _arg *arg) {
 	if (c->uri && strcmp(u, c->uri) == 0)
 		reload(c, &a);
 	else {
+		siteapply(c, sitelookup(u));
 		webkit_web_view_load_uri(c->view, u);
 	}
 	g_free(u);
 }
 
+static void
+lowmemory(GMemoryMonitor *m, GMemoryMonitorWarningLevel level, gpointer unused) {
+	struct _client *c;
+
+	memorylow = g_get_monotonic_time();
+	for (c = clients; c; c = c->next)
+		prerenderdrop(c);
+	discardall(0);
+}
+
 static void
 mousetargetchanged(WebKitWebView *v, WebKitHitTestResult *h, guint mods,
     struct _client *c) {
@@ -557,6 +3806,23 @@ mousetargetchanged(WebKitWebView *v, WebKitHitTestResult *h, guint mods,
 		c->hovertitle = copystr(&c->hovertitle, NULL);
 	}
 
+	/* only links the pointer rests on, not those it passes over */
+	if (c->prefetchtimer) {
+		g_source_remove(c->prefetchtimer);
+		c->prefetchtimer = 0;
+	}
+	if (c->hoveruri && prefetchdelay)
+		c->prefetchtimer = g_timeout_add(prefetchdelay, prefetch, c);
+
+	if (c->prerender && g_strcmp0(c->hoveruri, c->prerenderuri))
+		prerenderdrop(c);
+	if (c->prerendertimer) {
+		g_source_remove(c->prerendertimer);
+		c->prerendertimer = 0;
+	}
+	if (c->hoveruri && prerenderdwell && c->prerender == NULL)
+		c->prerendertimer = g_timeout_add(prerenderdwell, prerender, c);
+
 	if (hc & WEBKIT_HIT_TEST_RESULT_CONTEXT_IMAGE)
 		c->hovercontent = copystr(&c->hovercontent,
 		    webkit_hit_test_result_get_image_uri(h));
@@ -573,6 +3839,39 @@ mousetargetchanged(WebKitWebView *v, WebKitHitTestResult *h, guint mods,
 	updatetitle(c);
 }
 
+/* Keeps the navigation in the ring of c and appends it to metricsfile. */
+static void
+navfinished(struct _client *c) {
+	GString *l;
+
+	if (c->nav.started == 0)
+		return;
+	c->nav.finished = g_get_monotonic_time();
+	c->navs[c->navcount++ % NAVRING] = c->nav;
+
+	if (metricsfp == NULL)
+		return;
+	l = g_string_new(NULL);
+	g_string_append_printf(l, "{\"time\":%" G_GINT64_FORMAT
+	    ",\"id\":%lu,\"uri\":", g_get_real_time() / G_USEC_PER_SEC,
+	    c->xwin);
+	jsonstr(l, c->uri);
+	if (c->nav.committed)
+		g_string_append_printf(l, ",\"commit_ms\":%.1f",
+		    (c->nav.committed - c->nav.started) / 1e3);
+	else
+		g_string_append(l, ",\"commit_ms\":null");
+	g_string_append_printf(l, ",\"finish_ms\":%.1f,\"redirects\":%u,"
+	    "\"resources\":%u,\"bytes\":%" G_GUINT64_FORMAT ","
+	    "\"fast_responses\":%u,\"slow_responses\":%u,\"prerendered\":%s}\n",
+	    (c->nav.finished - c->nav.started) / 1e3, c->nav.redirects,
+	    c->nav.resources, c->nav.bytes, c->nav.fastresponses,
+	    c->nav.slowresponses, c->nav.prerendered ? "true" : "false");
+	fputs(l->str, metricsfp);
+	fflush(metricsfp);
+	g_string_free(l, TRUE);
+}
+
 static void
 navigate(struct _client *c, const union _arg *arg) {
 	int steps;
@@ -586,10 +3885,8 @@ navigate(struct _client *c, const union _arg *arg) {
 }
 
 static struct _client *
-newclient(void) {
+newclient(Window e, bool lazy) {
 	struct _client *c;
-	char *ua;
-	WebKitSettings *settings;
 	union _arg arg;
 
 	c = calloc(1, sizeof(struct _client));
@@ -606,10 +3903,12 @@ newclient(void) {
 	c->sslfailed = FALSE;
 	c->insecure = FALSE;
 	c->inspecting = FALSE;
-	c->styled = FALSE;
+	c->lastseen = g_get_monotonic_time();
+	c->har = g_ptr_array_new_with_free_func(harfree);
+	c->prerenderhar = g_ptr_array_new_with_free_func(harfree);
 
-	if (embed)
-		c->win = gtk_plug_new(embed);
+	if (e)
+		c->win = gtk_plug_new(e);
 	else
 		c->win = gtk_window_new(GTK_WINDOW_TOPLEVEL);
 
@@ -620,67 +3919,36 @@ newclient(void) {
 	g_signal_connect(c->win,
 	    "destroy",
 	    G_CALLBACK(destroywin), c);
-
-	gtk_widget_show(c->win);
+	g_signal_connect(c->win, "focus-in-event",
+	    G_CALLBACK(winevent), c);
+	g_signal_connect(c->win, "key-press-event",
+	    G_CALLBACK(findkeypress), c);
+	g_signal_connect(c->win, "focus-out-event",
+	    G_CALLBACK(winevent), c);
+	g_signal_connect(c->win, "map-event",
+	    G_CALLBACK(winevent), c);
+
+	/* mapped by show(), so pooled windows stay hidden */
+	gtk_widget_realize(c->win);
 
 	c->xwin = GDK_WINDOW_XID(gtk_widget_get_window(GTK_WIDGET(c->win)));
 
 	gdk_window_set_events(gtk_widget_get_window(GTK_WIDGET(c->win)), GDK_ALL_EVENTS_MASK);
 	gdk_window_add_filter(gtk_widget_get_window(GTK_WIDGET(c->win)), processx, c);
 
-	addaccelgroup(c);
-
-	c->view = WEBKIT_WEB_VIEW(webkit_web_view_new_with_user_content_manager(
-	    webkit_user_content_manager_new()));
-
-	gtk_container_add(GTK_CONTAINER(c->win), GTK_WIDGET(c->view));
-
-	g_signal_connect(c->view, "notify::estimated-load-progress",
-	    G_CALLBACK(loadprogressed), c);
-	g_signal_connect(c->view, "notify::title",
-	    G_CALLBACK(titlechanged), c);
-	g_signal_connect(c->view, "create",
-	    G_CALLBACK(createwindow), c);
-	g_signal_connect(c->view, "decide-policy",
-	    G_CALLBACK(decidepolicy), c);
-	g_signal_connect(c->view, "insecure-content-detected",
-	    G_CALLBACK(insecurecontent), c);
-	g_signal_connect(c->view, "load-changed",
-	    G_CALLBACK(loadchanged), c);
-	g_signal_connect(c->view, "mouse-target-changed",
-	    G_CALLBACK(mousetargetchanged), c);
-	g_signal_connect(c->view, "permission-request",
-	    G_CALLBACK(permissionrequest), c);
-	g_signal_connect(c->view, "ready-to-show",
-	    G_CALLBACK(show), c);
-	g_signal_connect(c->view, "resource-load-started",
-	    G_CALLBACK(resourceloadstarted), c);
+	if (deferred)
+		addaccelgroup(c);
 
-	settings = webkit_web_view_get_settings(c->view);
-	webkit_settings_set_auto_load_images(settings, loadimages);
-	webkit_settings_set_default_charset(settings, defaultcharset);
-	webkit_settings_set_enable_caret_browsing(settings, enablecaretbrowsing);
-	webkit_settings_set_enable_developer_extras(settings, enableinspector);
-	webkit_settings_set_enable_dns_prefetching(settings, enablednsprefetch);
-	webkit_settings_set_enable_java(settings, enablejava);
-	webkit_settings_set_enable_javascript(settings, enablejavascript);
-	webkit_settings_set_enable_plugins(settings, enableplugins);
-	webkit_settings_set_enable_site_specific_quirks(settings, enablesitequirks);
-	webkit_settings_set_enable_smooth_scrolling(settings, enablesmoothscrolling);
-	webkit_settings_set_default_font_size(settings, defaultfontsize);
-	webkit_settings_set_media_playback_requires_user_gesture(settings, nomediaautoplay);
-	if ((ua = getenv("SURF_USERAGENT")) == NULL)
-		ua = useragent;
-	webkit_settings_set_user_agent(settings, ua);
-	/* Read http://webkitgtk.org/reference/webkit2gtk/stable/WebKitSettings.html
-	 * for more interesting WebKit settings */
+	c->settings = newsettings();
 
-	c->finder = webkit_web_view_get_find_controller(c->view);
+	gettogglestats(c);
 
-	if (enableinspector)
-		c->inspector = webkit_web_view_get_inspector(c->view);
+	/* placeholders get their view from wake() */
+	c->zoom = 1.0;
+	if (!lazy)
+		newview(c);
 
-	if (zoomlevel != 1) {
+	if (!lazy && zoomlevel != 1) {
 		arg.i = zoomlevel;
 		zoom(c, &arg);
 	}
@@ -694,6 +3962,8 @@ newclient(void) {
 		fflush(NULL);
 		if (fclose(stdout))
 			die("newclient(): Error closing stdout");
+		/* only the first window of a process can report its xid */
+		showwinid = false;
 	}
 
 	setatom(c, ATOMFIND, "");
@@ -705,12 +3975,67 @@ newclient(void) {
 	return c;
 }
 
+/* Also used for the views of batch mode. */
+static WebKitSettings *
+newsettings(void) {
+	char *ua;
+	WebKitSettings *settings;
+
+	settings = webkit_settings_new();
+	webkit_settings_set_auto_load_images(settings, loadimages);
+	webkit_settings_set_default_charset(settings, defaultcharset);
+	webkit_settings_set_enable_caret_browsing(settings, enablecaretbrowsing);
+	webkit_settings_set_enable_developer_extras(settings, enableinspector);
+	webkit_settings_set_enable_dns_prefetching(settings, enablednsprefetch);
+	webkit_settings_set_enable_java(settings, enablejava);
+	webkit_settings_set_enable_javascript(settings, enablejavascript);
+	webkit_settings_set_enable_plugins(settings, enableplugins);
+	webkit_settings_set_enable_site_specific_quirks(settings, enablesitequirks);
+	webkit_settings_set_enable_smooth_scrolling(settings, enablesmoothscrolling);
+	webkit_settings_set_default_font_size(settings, defaultfontsize);
+	webkit_settings_set_media_playback_requires_user_gesture(settings, nomediaautoplay);
+	if ((ua = getenv("SURF_USERAGENT")) == NULL)
+		ua = useragent;
+	webkit_settings_set_user_agent(settings, ua);
+	/* Read http://webkitgtk.org/reference/webkit2gtk/stable/WebKitSettings.html
+	 * for more interesting WebKit settings */
+
+	return settings;
+}
+
+static void
+newview(struct _client *c) {
+	/* the settings belong to the window and survive discard() */
+	c->view = WEBKIT_WEB_VIEW(g_object_new(WEBKIT_TYPE_WEB_VIEW,
+	    "web-context", context,
+	    "settings", c->settings,
+	    "user-content-manager", contentmanager,
+	    "related-view", webprocshare(c), NULL));
+	c->webpid = 0;
+
+	attachview(c);
+}
+
 static void
 newwindow(struct _client *c, const union _arg *arg, bool noembed) {
 	int i;
-	const char *cmd[16], *uri;
+	const char *cmd[24], *uri;
 	char tmp[64];
-	const union _arg a = { .v = cmd };
+	struct _client *n;
+	union _arg u;
+
+	uri = arg->v ? (char *)arg->v : c->hoveruri;
+
+	if (inprocesswindows) {
+		n = getclient(noembed ? 0 : embed);
+		show(NULL, n);
+		if (uri) {
+			u.v = uri;
+			loaduri(n, &u);
+		} else
+			updatetitle(n);
+		return;
+	}
 
 	i = 0;
 
@@ -730,6 +4055,8 @@ newwindow(struct _client *c, const union _arg *arg, bool noembed) {
 		cmd[i++] = "-k";
 	if (!enableplugins)
 		cmd[i++] = "-p";
+	if (cookiestorage == WEBKIT_COOKIE_PERSISTENT_STORAGE_SQLITE)
+		cmd[i++] = "-Q";
 	if (!enablejavascript)
 		cmd[i++] = "-s";
 	if (showwinid)
@@ -737,11 +4064,10 @@ newwindow(struct _client *c, const union _arg *arg, bool noembed) {
 	cmd[i++] = "-c";
 	cmd[i++] = cookiefile;
 	cmd[i++] = "--";
-	uri = arg->v ? (char *)arg->v : c->hoveruri;
 	if (uri)
 		cmd[i++] = uri;
 	cmd[i++] = NULL;
-	spawn(NULL, &a);
+	spawnargv((char **)cmd, exited, NULL);
 }
 
 static void
@@ -771,6 +4097,232 @@ permissionrequest(WebKitWebView *v, WebKitPermissionRequest *p,
 	return FALSE;
 }
 
+/*
+ * Resolves the host of the hovered link ahead of the click and has the
+ * page preconnect to it, which WebKit does for a <link rel=preconnect>
+ * with DNS, TCP and TLS. Every host once per session, at most
+ * prefetchbudget of them. Without JavaScript only the name is resolved.
+ */
+static gboolean
+prefetch(gpointer p) {
+	struct _client *c;
+	SoupURI *u;
+	gchar *script;
+
+	c = p;
+	c->prefetchtimer = 0;
+
+	if (prefetched == NULL)
+		prefetched = g_hash_table_new_full(g_str_hash, g_str_equal,
+		    g_free, NULL);
+	if (g_hash_table_size(prefetched) >= prefetchbudget)
+		return FALSE;
+
+	if ((u = soup_uri_new(c->hoveruri)) == NULL)
+		return FALSE;
+	/* blocked hosts are not even looked up */
+	if (SOUP_URI_VALID_FOR_HTTP(u) && !adblocked(c->hoveruri)
+	    && !g_hash_table_contains(prefetched, u->host)) {
+		g_hash_table_add(prefetched, g_strdup(u->host));
+		webkit_web_context_prefetch_dns(context, u->host);
+		/* the origin is pasted into the script, plain names only */
+		if (u->host[strspn(u->host, "abcdefghijklmnopqrstuvwxyz"
+		    "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-")] == '\0') {
+			script = g_strdup_printf("(function () {\n"
+			    "var l = document.createElement('link');\n"
+			    "l.rel = 'preconnect';\n"
+			    "l.href = '%s://%s:%u/';\n"
+			    "(document.head || document.documentElement)"
+			    ".appendChild(l);\n})();", u->scheme, u->host,
+			    u->port);
+			webkit_web_view_run_javascript(c->view, script, NULL,
+			    NULL, NULL);
+			g_free(script);
+		}
+	}
+	soup_uri_free(u);
+
+	return FALSE;
+}
+
+/*
+ * Load the same-site link the pointer rests on in a hidden view related to
+ * c->view, so that clicking it only swaps views, see decidepolicy().
+ */
+static gboolean
+prerender(gpointer p) {
+	struct _client *c;
+	WebKitWebViewSessionState *s;
+
+	c = p;
+	c->prerendertimer = 0;
+
+	if (c->view == NULL || c->prerender || c->hoveruri == NULL
+	    || prerenders >= prerendermax
+	    || !samesite(c->uri, c->hoveruri))
+		return FALSE;
+	if (memorylow && g_get_monotonic_time() - memorylow
+	    < LOWMEMPAUSE * G_USEC_PER_SEC)
+		return FALSE;
+
+	c->prerender = WEBKIT_WEB_VIEW(g_object_new(WEBKIT_TYPE_WEB_VIEW,
+	    "related-view", c->view,
+	    "settings", c->settings,
+	    "user-content-manager", contentmanager, NULL));
+	g_object_ref_sink(c->prerender);
+	g_signal_connect(c->prerender, "decide-policy",
+	    G_CALLBACK(decidepolicy), c);
+	g_signal_connect(c->prerender, "load-changed",
+	    G_CALLBACK(prerendered), c);
+	g_signal_connect(c->prerender, "permission-request",
+	    G_CALLBACK(permissionrequest), c);
+	g_signal_connect(c->prerender, "resource-load-started",
+	    G_CALLBACK(resourceloadstarted), c);
+	g_ptr_array_set_size(c->prerenderhar, 0);
+	memset(&c->prerendernav, 0, sizeof(c->prerendernav));
+
+	/* the window keeps its history once the view is swapped in */
+	s = webkit_web_view_get_session_state(c->view);
+	webkit_web_view_restore_session_state(c->prerender, s);
+	webkit_web_view_session_state_unref(s);
+	webkit_web_view_set_zoom_level(c->prerender,
+	    webkit_web_view_get_zoom_level(c->view));
+
+	c->prerenderuri = g_strdup(c->hoveruri);
+	c->prerenderstarted = g_get_monotonic_time();
+	c->prerenderfinished = 0;
+	c->prerenderload = WEBKIT_LOAD_STARTED;
+	prerenders++;
+	webkit_web_view_load_uri(c->prerender, c->prerenderuri);
+
+	return FALSE;
+}
+
+static void
+prerenderdrop(struct _client *c) {
+	if (c->prerendertimer) {
+		g_source_remove(c->prerendertimer);
+		c->prerendertimer = 0;
+	}
+	if (c->prerenderidle) {
+		g_source_remove(c->prerenderidle);
+		c->prerenderidle = 0;
+	}
+	if (c->prerender == NULL)
+		return;
+
+	webkit_web_view_stop_loading(c->prerender);
+	g_ptr_array_set_size(c->prerenderhar, 0);
+	gtk_widget_destroy(GTK_WIDGET(c->prerender));
+	g_object_unref(c->prerender);
+	c->prerender = NULL;
+	c->prerenderpid = 0;
+	g_free(c->prerenderuri);
+	c->prerenderuri = NULL;
+	prerenders--;
+	prerendermisses++;
+}
+
+static void
+prerendered(WebKitWebView *v, WebKitLoadEvent e, struct _client *c) {
+	c->prerenderload = e;
+	if (e == WEBKIT_LOAD_COMMITTED)
+		c->prerenderpid = webprocclaim(c, v);
+	/*
+	 * Redirected to another site, the page would need other site rules
+	 * than the settings it shares with the window. The view is dropped
+	 * and a click loads the link the usual way.
+	 */
+	if (e == WEBKIT_LOAD_COMMITTED
+	    && !samesite(c->uri, webkit_web_view_get_uri(v))) {
+		g_free(c->prerenderuri);
+		c->prerenderuri = NULL;
+		if (c->prerenderidle == 0)
+			c->prerenderidle = g_idle_add(prerenderstale, c);
+	}
+	if (e == WEBKIT_LOAD_FINISHED)
+		c->prerenderfinished = g_get_monotonic_time();
+}
+
+/*
+ * Drop a prerender that cannot be shown, from the main loop, since the
+ * view is still emitting the signal that found it out.
+ */
+static gboolean
+prerenderstale(gpointer p) {
+	struct _client *c;
+
+	c = p;
+	c->prerenderidle = 0;
+	prerenderdrop(c);
+
+	return FALSE;
+}
+
+/*
+ * Replace c->view by the prerendered view. The old view is still emitting
+ * decide-policy, so it is only taken out of the window here and destroyed
+ * once the main loop is idle.
+ */
+static void
+prerenderswap(struct _client *c) {
+	WebKitWebView *v;
+	GPtrArray *har;
+	gint64 now;
+
+	now = g_get_monotonic_time();
+	prerenders--;
+	prerenderhits++;
+	prerendersaved += (c->prerenderfinished ? c->prerenderfinished : now)
+	    - c->prerenderstarted;
+
+	/* the inspector goes with the old view */
+	if (c->inspecting)
+		webkit_web_inspector_close(WEBKIT_WEB_INSPECTOR(c->inspector));
+	c->inspector = NULL;
+	c->inspecting = FALSE;
+
+	v = c->view;
+	g_signal_handlers_disconnect_by_data(v, c);
+	g_object_ref(v);
+	gtk_container_remove(GTK_CONTAINER(c->win), GTK_WIDGET(v));
+	webkit_web_view_stop_loading(v);
+	g_idle_add(dropview, v);
+
+	g_signal_handlers_disconnect_by_data(c->prerender, c);
+	c->view = c->prerender;
+	c->prerender = NULL;
+	/* related to the old view, it is in the same process unless known */
+	if (c->prerenderpid)
+		c->webpid = c->prerenderpid;
+	c->prerenderpid = 0;
+	g_free(c->prerenderuri);
+	c->prerenderuri = NULL;
+	attachview(c);
+	/* the window holds the view now */
+	g_object_unref(c->view);
+	gtk_widget_show(GTK_WIDGET(c->view));
+	gtk_widget_grab_focus(GTK_WIDGET(c->view));
+
+	/* replay what the window missed of the load */
+	c->scrolling = FALSE;
+	loadchanged(c->view, WEBKIT_LOAD_STARTED, c);
+	c->nav.prerendered = TRUE;
+	c->nav.resources = c->prerendernav.resources;
+	c->nav.bytes = c->prerendernav.bytes;
+	c->nav.fastresponses = c->prerendernav.fastresponses;
+	c->nav.slowresponses = c->prerendernav.slowresponses;
+	har = c->har;
+	c->har = c->prerenderhar;
+	c->prerenderhar = har;
+	if (c->prerenderload >= WEBKIT_LOAD_COMMITTED)
+		loadchanged(c->view, WEBKIT_LOAD_COMMITTED, c);
+	if (c->prerenderload == WEBKIT_LOAD_FINISHED)
+		loadchanged(c->view, WEBKIT_LOAD_FINISHED, c);
+	titlechanged(c->view, NULL, c);
+	loadprogressed(c->view, NULL, c);
+}
+
 static void
 print(struct _client *c, const union _arg *a) {
 	webkit_print_operation_run_dialog(webkit_print_operation_new(c->view),
@@ -788,69 +4340,460 @@ processx(GdkXEvent *xe, GdkEvent *e, gpointer p) {
 	if (((XEvent *)xe)->type == PropertyNotify) {
 		ev = &((XEvent *)xe)->xproperty;
 		if (ev->state == PropertyNewValue) {
+			if (ev->atom == atoms[ATOMFIND]
+			    || ev->atom == atoms[ATOMGO])
+				wake(c);
 			if (ev->atom == atoms[ATOMFIND]) {
+				c->findtext = copystr(&c->findtext,
+				    getatom(c, ATOMFIND));
 				arg.b = TRUE;
 				find(c, &arg);
 
-				return GDK_FILTER_REMOVE;
-			} else if (ev->atom == atoms[ATOMGO]) {
-				arg.v = getatom(c, ATOMGO);
-				loaduri(c, &arg);
+				return GDK_FILTER_REMOVE;
+			} else if (ev->atom == atoms[ATOMGO]) {
+				arg.v = getatom(c, ATOMGO);
+				loaduri(c, &arg);
+
+				return GDK_FILTER_REMOVE;
+			}
+		}
+	}
+	return GDK_FILTER_CONTINUE;
+}
+
+static void
+reload(struct _client *c, const union _arg *arg) {
+	gboolean nocache = arg->b;
+	if (nocache)
+		 webkit_web_view_reload_bypass_cache(c->view);
+	else
+		 webkit_web_view_reload(c->view);
+}
+
+static void
+resourcefailed(WebKitWebResource *res, GError *err, struct _har *h) {
+	copystr(&h->error, err->message);
+	resourcefinished(res, h);
+}
+
+/* The entry keeps its numbers, the resource and its data are let go. */
+static void
+resourcefinished(WebKitWebResource *res, struct _har *h) {
+	if (!h->finished)
+		h->finished = g_get_real_time();
+	g_signal_handlers_disconnect_by_data(res, h);
+	g_clear_object(&h->res);
+}
+
+static void
+resourceloadstarted(WebKitWebView *v, WebKitWebResource *res,
+    WebKitURIRequest *req, struct _client *c) {
+	struct _har *h;
+	GPtrArray *har;
+	const gchar *uri;
+
+	uri = webkit_uri_request_get_uri(req);
+
+	if (g_str_has_suffix(uri, "/favicon.ico")) {
+		webkit_uri_request_set_uri(req, "about:blank");
+		return;
+	}
+
+	/* a prerender keeps its own until it is swapped in */
+	har = v == c->view ? c->har : c->prerenderhar;
+
+	/* pages that keep loading, like polling ones, keep only the last */
+	if (har->len && har->len >= harmax)
+		g_ptr_array_remove_index(har, 0);
+
+	h = g_malloc0(sizeof(struct _har));
+	h->c = c;
+	h->view = v;
+	resourcenav(h)->resources++;
+	h->res = g_object_ref(res);
+	h->method = g_strdup(webkit_uri_request_get_http_method(req));
+	h->uri = g_strdup(uri);
+	h->started = g_get_real_time();
+	g_ptr_array_add(har, h);
+
+	g_signal_connect(res, "failed", G_CALLBACK(resourcefailed), h);
+	g_signal_connect(res, "finished", G_CALLBACK(resourcefinished), h);
+	g_signal_connect(res, "notify::response",
+	    G_CALLBACK(resourceresponded), h);
+	g_signal_connect(res, "received-data",
+	    G_CALLBACK(resourcereceived), h);
+}
+
+/* The navigation h counts to, a hidden prerender has its own. */
+static struct _nav *
+resourcenav(struct _har *h) {
+	return h->view == h->c->view ? &h->c->nav : &h->c->prerendernav;
+}
+
+static void
+resourcereceived(WebKitWebResource *res, guint64 len, struct _har *h) {
+	h->size += len;
+	resourcenav(h)->bytes += len;
+}
+
+static void
+resourceresponded(WebKitWebResource *res, GParamSpec *s, struct _har *h) {
+	WebKitURIResponse *r;
+
+	if ((r = webkit_web_resource_get_response(res)) == NULL)
+		return;
+	h->responded = g_get_real_time();
+	h->status = webkit_uri_response_get_status_code(r);
+
+	/*
+	 * WebKit does not say where a response came from, and a revalidated
+	 * one is reported as a 200. Responses faster than FASTUSEC are
+	 * counted as fast: the cache, but also a server on the LAN.
+	 */
+	if (g_str_has_prefix(h->uri, "http")) {
+		if (h->responded - h->started < FASTUSEC)
+			resourcenav(h)->fastresponses++;
+		else
+			resourcenav(h)->slowresponses++;
+	}
+	copystr(&h->mime, webkit_uri_response_get_mime_type(r));
+}
+
+/*
+ * Windows come back as placeholders like discarded ones, so only the
+ * focused window starts loading.
+ */
+static guint
+restoresession(void) {
+	struct _client *c;
+	GPtrArray *records;
+	GBytes *bytes;
+	gchar *buf;
+	const guint8 *p, *end, *uri, *title, *state;
+	gsize len, urilen, titlelen, statelen;
+	gdouble zoom;
+	guint32 flags;
+	guint n;
+
+	if (!g_file_get_contents(sessionfile, &buf, &len, NULL))
+		return 0;
+	if (len < strlen(SESSIONMAGIC)
+	    || memcmp(buf, SESSIONMAGIC, strlen(SESSIONMAGIC))) {
+		g_free(buf);
+		return 0;
+	}
+
+	/* created backwards, so clients ends up in the saved order */
+	records = g_ptr_array_new();
+	p = (guint8 *)buf + strlen(SESSIONMAGIC);
+	end = (guint8 *)buf + len;
+	while (end - p > sizeof(zoom) + sizeof(flags)) {
+		g_ptr_array_add(records, (gpointer)p);
+		p += sizeof(zoom) + sizeof(flags);
+		if (!sessionget(&p, end, &urilen)
+		    || !sessionget(&p, end, &titlelen)
+		    || !sessionget(&p, end, &statelen)) {
+			g_ptr_array_remove_index(records, records->len - 1);
+			break;
+		}
+	}
+
+	for (n = records->len; n > 0; n--) {
+		p = g_ptr_array_index(records, n - 1);
+		memcpy(&zoom, p, sizeof(zoom));
+		p += sizeof(zoom);
+		memcpy(&flags, p, sizeof(flags));
+		p += sizeof(flags);
+		uri = sessionget(&p, end, &urilen);
+		title = sessionget(&p, end, &titlelen);
+		state = sessionget(&p, end, &statelen);
+
+		c = newclient(embed, true);
+		c->placeholder = TRUE;
+		c->zoom = zoom;
+		webkit_settings_set_enable_caret_browsing(c->settings,
+		    flags & SESSCARET);
+		webkit_settings_set_auto_load_images(c->settings,
+		    flags & SESSIMAGES);
+		webkit_settings_set_enable_javascript(c->settings,
+		    flags & SESSSCRIPTS);
+		webkit_settings_set_enable_plugins(c->settings,
+		    flags & SESSPLUGINS);
+		gettogglestats(c);
+
+		c->sessionuri = g_strndup((const gchar *)uri, urilen);
+		c->uri = c->sessionuri;
+		c->title = g_strndup((const gchar *)title, titlelen);
+		if (statelen) {
+			bytes = g_bytes_new(state, statelen);
+			c->session = webkit_web_view_session_state_new(bytes);
+			g_bytes_unref(bytes);
+		}
+
+		setatom(c, ATOMURI, c->uri);
+		gtk_widget_show_all(c->win);
+		updatetitle(c);
+	}
+
+	n = records->len;
+	g_ptr_array_free(records, TRUE);
+	g_free(buf);
+
+	return n;
+}
+
+/* Whether b is another page on the host of a. */
+static gboolean
+samesite(const gchar *a, const gchar *b) {
+	SoupURI *u, *v;
+	gboolean r;
+
+	u = a ? soup_uri_new(a) : NULL;
+	v = b ? soup_uri_new(b) : NULL;
+	r = u && v && SOUP_URI_VALID_FOR_HTTP(u) && SOUP_URI_VALID_FOR_HTTP(v)
+	    && soup_uri_host_equal(u, v)
+	    && (g_strcmp0(u->path, v->path) || g_strcmp0(u->query, v->query));
+	if (u)
+		soup_uri_free(u);
+	if (v)
+		soup_uri_free(v);
+
+	return r;
+}
+
+/* Only the records of windows that changed are built again. */
+static gboolean
+savesession(gpointer unused) {
+	struct _client *c;
+	GByteArray *b;
+	GError *err = NULL;
+	gconstpointer data;
+	gsize len;
+
+	sessionidle = 0;
+
+	b = g_byte_array_new();
+	g_byte_array_append(b, (const guint8 *)SESSIONMAGIC,
+	    strlen(SESSIONMAGIC));
+	for (c = clients; c; c = c->next) {
+		if (c->uri == NULL)
+			continue;
+		if (c->sessionrecord == NULL)
+			c->sessionrecord = sessionrecord(c);
+		data = g_bytes_get_data(c->sessionrecord, &len);
+		g_byte_array_append(b, data, len);
+	}
+
+	/* written to a temporary file and renamed, a crash keeps the old one */
+	if (!g_file_set_contents(sessionfile, (gchar *)b->data, b->len,
+	    &err)) {
+		fprintf(stderr, "surf: cannot write %s: %s\n", sessionfile,
+		    err->message);
+		g_error_free(err);
+	}
+	g_byte_array_free(b, TRUE);
+
+	return FALSE;
+}
 
-				return GDK_FILTER_REMOVE;
-			}
-		}
+/* Append s..e as a regular expression, '*' matching anything. */
+static void
+scriptglob(GString *re, const char *s, const char *e) {
+	for (; s < e; s++) {
+		if (*s == '*')
+			g_string_append(re, ".*");
+		else if (strchr("\\^$.|?+()[]{}/", *s))
+			g_string_append_printf(re, "\\%c", *s);
+		else
+			g_string_append_c(re, *s);
 	}
-	return GDK_FILTER_CONTINUE;
 }
 
+/*
+ * Append a test of location.href against the @include or @exclude glob
+ * pat or, with match, the @match pattern pat. The scheme '*' of a match
+ * pattern is http or https and a host "*." any or no subdomain.
+ */
 static void
-reload(struct _client *c, const union _arg *arg) {
-	gboolean nocache = arg->b;
-	if (nocache)
-		 webkit_web_view_reload_bypass_cache(c->view);
-	else
-		 webkit_web_view_reload(c->view);
+scriptpattern(GString *js, const char *pat, gboolean match) {
+	const char *h;
+
+	if (js->len)
+		g_string_append(js, " || ");
+	g_string_append(js, "/^");
+	if (match && !strcmp(pat, "<all_urls>")) {
+		pat = "*";
+	} else if (match && (h = strstr(pat, "://")) != NULL) {
+		if (h == pat + 1 && *pat == '*')
+			g_string_append(js, "https?");
+		else
+			scriptglob(js, pat, h);
+		g_string_append(js, ":\\/\\/");
+		pat = h + 3;
+		if (pat[0] == '*' && pat[1] == '.') {
+			g_string_append(js, "([^/]*\\.)?");
+			pat += 2;
+		} else if (pat[0] == '*') {
+			g_string_append(js, "[^/]*");
+			pat++;
+		}
+	}
+	scriptglob(js, pat, pat + strlen(pat));
+	g_string_append(js, "$/.test(location.href)");
 }
 
+/*
+ * Scrolling is a wheel event sent to the view, which works without
+ * JavaScript and honours enablesmoothscrolling. Steps arriving from key
+ * repeat are summed up and sent once per frame.
+ */
 static void
-resourceloadstarted(WebKitWebView *v, WebKitWebResource *res,
-    WebKitURIRequest *req, struct _client *c) {
-	const gchar *uri;
+scroll(struct _client *c) {
+	if (c->scrolling || (c->scrollx == 0 && c->scrolly == 0))
+		return;
 
-	uri = webkit_uri_request_get_uri(req);
+	c->scrolling = TRUE;
+	gtk_widget_add_tick_callback(GTK_WIDGET(c->view), scrolltick, c, NULL);
+}
 
-	if (g_str_has_suffix(uri, "/favicon.ico"))
-		webkit_uri_request_set_uri(req, "about:blank");
+static void
+scroll_v(struct _client *c, const union _arg *arg) {
+	c->scrolly += arg->i;
+	scroll(c);
 }
 
 static void
-runjavascript(WebKitWebView *v, const char *jsstr, ...) {
-	va_list ap;
-	gchar *script;
+scroll_h(struct _client *c, const union _arg *arg) {
+	c->scrollx += arg->i;
+	scroll(c);
+}
 
-	va_start(ap, jsstr);
-	script = g_strdup_vprintf(jsstr, ap);
-	va_end(ap);
-	webkit_web_view_run_javascript(v, script, NULL, NULL, NULL);
-	g_free(script);
+/* A step is a tenth of the view. */
+static gboolean
+scrolltick(GtkWidget *w, GdkFrameClock *fc, gpointer p) {
+	struct _client *c;
+	GdkEvent *ev;
+	GdkWindow *win;
+	GtkAllocation a;
+
+	c = p;
+	/* a view swapped out of the window keeps its tick until destroyed */
+	if (w != GTK_WIDGET(c->view))
+		return G_SOURCE_REMOVE;
+	c->scrolling = FALSE;
+	if ((win = gtk_widget_get_window(w)) == NULL)
+		return G_SOURCE_REMOVE;
+
+	gtk_widget_get_allocation(w, &a);
+	ev = gdk_event_new(GDK_SCROLL);
+	ev->scroll.window = g_object_ref(win);
+	ev->scroll.send_event = TRUE;
+	ev->scroll.time = GDK_CURRENT_TIME;
+	ev->scroll.x = a.width / 2;
+	ev->scroll.y = a.height / 2;
+	ev->scroll.direction = GDK_SCROLL_SMOOTH;
+	ev->scroll.delta_x = c->scrollx * a.width / 10.0 / SCROLLLINE;
+	ev->scroll.delta_y = c->scrolly * a.height / 10.0 / SCROLLLINE;
+	gdk_event_set_device(ev, gdk_seat_get_pointer(
+	    gdk_display_get_default_seat(gdk_window_get_display(win))));
+	c->scrollx = c->scrolly = 0;
+
+	gtk_widget_event(w, ev);
+	gdk_event_free(ev);
+
+	return G_SOURCE_REMOVE;
 }
 
+/* c is NULL when a window was closed. */
 static void
-scroll_v(struct _client *c, const union _arg *arg) {
-	runjavascript(c->view,
-		"window.scrollBy(0, %d * (window.innerHeight / 10))", arg->i);
+sessionchanged(struct _client *c) {
+	if (c && c->sessionrecord) {
+		g_bytes_unref(c->sessionrecord);
+		c->sessionrecord = NULL;
+	}
+	if (!sessionidle)
+		sessionidle = g_timeout_add_seconds(2, savesession, NULL);
+}
+
+static const guint8 *
+sessionget(const guint8 **p, const guint8 *end, gsize *len) {
+	const guint8 *s;
+	guint32 n;
+
+	if (end - *p < sizeof(n))
+		return NULL;
+	memcpy(&n, *p, sizeof(n));
+	if (end - *p - sizeof(n) < n)
+		return NULL;
+	s = *p + sizeof(n);
+	*p = s + n;
+	*len = n;
+
+	return s;
 }
 
 static void
-scroll_h(struct _client *c, const union _arg *arg) {
-	runjavascript(c->view,
-		"window.scrollBy(%d * (window.innerWidth / 10), 0)", arg->i);
+sessionput(GByteArray *b, const void *s, gsize len) {
+	guint32 n;
+
+	n = len;
+	g_byte_array_append(b, (const guint8 *)&n, sizeof(n));
+	if (n)
+		g_byte_array_append(b, s, n);
+}
+
+/*
+ * A record is the zoom level as gdouble, the _sessflag toggles as guint32,
+ * then uri, title and the serialized WebKitWebViewSessionState as guint32
+ * length and bytes. Host byte order, the file is not meant to be moved.
+ */
+static GBytes *
+sessionrecord(struct _client *c) {
+	GByteArray *b;
+	GBytes *data;
+	WebKitWebViewSessionState *state;
+	gconstpointer s;
+	gdouble zoom;
+	guint32 flags;
+	gsize len;
+
+	if (c->view) {
+		state = webkit_web_view_get_session_state(c->view);
+		zoom = webkit_web_view_get_zoom_level(c->view);
+	} else {
+		state = c->session ?
+		    webkit_web_view_session_state_ref(c->session) : NULL;
+		zoom = c->zoom;
+	}
+	flags = 0;
+	if (webkit_settings_get_enable_caret_browsing(c->settings))
+		flags |= SESSCARET;
+	if (webkit_settings_get_auto_load_images(c->settings))
+		flags |= SESSIMAGES;
+	if (webkit_settings_get_enable_javascript(c->settings))
+		flags |= SESSSCRIPTS;
+	if (webkit_settings_get_enable_plugins(c->settings))
+		flags |= SESSPLUGINS;
+
+	b = g_byte_array_new();
+	g_byte_array_append(b, (const guint8 *)&zoom, sizeof(zoom));
+	g_byte_array_append(b, (const guint8 *)&flags, sizeof(flags));
+	sessionput(b, c->uri, strlen(c->uri));
+	sessionput(b, c->title, c->title ? strlen(c->title) : 0);
+	if (state) {
+		data = webkit_web_view_session_state_serialize(state);
+		s = g_bytes_get_data(data, &len);
+		sessionput(b, s, len);
+		g_bytes_unref(data);
+		webkit_web_view_session_state_unref(state);
+	} else
+		sessionput(b, NULL, 0);
+
+	return g_byte_array_free_to_bytes(b);
 }
 
 static void
 setatom(struct _client *c, enum _atom a, const char *v) {
-	XSync(dpy, false);
 	XChangeProperty(dpy, c->xwin, atoms[a], XA_STRING, 8,
 	    PropModeReplace, (unsigned char *)v, strlen(v) + 1);
 }
@@ -876,40 +4819,56 @@ setcookiepolicy(const WebKitCookieAcceptPolicy p) {
 }
 
 static void
-setup(int *argc, char **argv[]) {
-	char *proxy;
-	WebKitWebContext *context;
-	WebKitCookieManager *cm;
-
-	/* clean up any zombies immediately */
-	sigchld(0);
+setup(void) {
+	char *proxy, *t;
+
+	tracestart = g_get_monotonic_time();
+	if ((t = getenv("SURF_TRACE")) != NULL) {
+		if (!strcmp(t, "-") || !*t)
+			tracefp = stderr;
+		else if ((tracefp = fopen(t, "ae")) == NULL)
+			fprintf(stderr, "surf: cannot open %s: %s\n", t,
+			    strerror(errno));
+	}
 
-	gtk_init(argc, argv);
+	/* main() has passed the GTK+ options to gtk_parse_args() */
+	gtk_init(NULL, NULL);
+	trace("gtk_init");
 
-	showwinid = false;
-	embed = 0;
-	cookiepolicy = 0;
+	/* argv0 for the commands of config.h, see HISTPROP */
+	strlcpy(self, argv0, sizeof(self));
 	dpy = GDK_DISPLAY_XDISPLAY(gdk_display_get_default());
 
 	atoms[ATOMFIND] = XInternAtom(dpy, "_SURF_FIND", false);
 	atoms[ATOMGO]   = XInternAtom(dpy, "_SURF_GO", false);
+	atoms[ATOMSTATS] = XInternAtom(dpy, "_SURF_STATS", false);
 	atoms[ATOMURI]  = XInternAtom(dpy, "_SURF_URI", false);
 
-	cookiefile = buildpath(cookiefile);
-	scriptfile = buildpath(scriptfile);
-	stylefile  = buildpath(stylefile);
+	adblockfile = buildpath(adblockfile);
+	sessionfile = buildpath(sessionfile);
+	hardir = buildpath(hardir);
+	if (historyfile) {
+		historyfile = buildpath(historyfile);
+		if ((histfp = fopen(historyfile, "ae")) == NULL)
+			fprintf(stderr, "surf: cannot open %s: %s\n",
+			    historyfile, strerror(errno));
+	}
+	if (metricsfile) {
+		metricsfile = buildpath(metricsfile);
+		if ((metricsfp = fopen(metricsfile, "ae")) == NULL)
+			fprintf(stderr, "surf: cannot open %s: %s\n",
+			    metricsfile, strerror(errno));
+	}
 
-	context = webkit_web_context_get_default();
+	trace("paths");
+	adblockload(adblockfile);
+	trace("adblock");
 
-	/* cookies */
-	cm = webkit_web_context_get_cookie_manager(context);
-	webkit_cookie_manager_set_persistent_storage(cm, cookiefile,
-	    WEBKIT_COOKIE_PERSISTENT_STORAGE_TEXT);
-	webkit_cookie_manager_set_accept_policy(cm, getcookiepolicy());
+	contentmanager = webkit_user_content_manager_new();
+	adblockfilter();
 
-	/* ssl */
-	webkit_web_context_set_tls_errors_policy(context, strictssl ?
-	    WEBKIT_TLS_ERRORS_POLICY_FAIL : WEBKIT_TLS_ERRORS_POLICY_IGNORE);
+	ctllisten();
+	trace("setup");
 
 	/* proxy */
 	if ((proxy = getenv("http_proxy")) && strcmp(proxy, ""))
@@ -920,31 +4879,284 @@ setup(int *argc, char **argv[]) {
 	clients = NULL;
 }
 
+/* Run after the arguments are parsed, so -C, -l and -m/-M take effect. */
+static void
+setupcontext(void) {
+	WebKitWebsiteDataManager *dm;
+
+	/* buildpath() would create a file at a path without / */
+	if (!g_str_has_suffix(cachedir, "/"))
+		cachedir = g_strconcat(cachedir, "/", NULL);
+	cachedir = buildpath(cachedir);
+	dm = webkit_website_data_manager_new("disk-cache-directory", cachedir,
+	    NULL);
+	context = webkit_web_context_new_with_website_data_manager(dm);
+	g_object_unref(dm);
+
+	webkit_web_context_set_cache_model(context, cachemodel);
+	/*
+	 * WebKitGTK 2.26 gives every view its own web process and ignores
+	 * these, webprocshare() keeps to the limit with related views
+	 */
+#if !WEBKIT_CHECK_VERSION(2, 26, 0)
+	webkit_web_context_set_process_model(context, processmodel);
+	if (webprocesslimit)
+		webkit_web_context_set_web_process_count_limit(context,
+		    webprocesslimit);
+#endif
+
+	/*
+	 * downloads, the directory is the user's own: it is created when
+	 * missing but its mode is left alone, unlike that of buildpath()
+	 */
+	downloaddir = abspath(downloaddir);
+	g_mkdir_with_parents(downloaddir, 0755);
+	g_signal_connect(context, "download-started",
+	    G_CALLBACK(downloadstarted), NULL);
+
+	/* ssl */
+	webkit_web_context_set_tls_errors_policy(context, strictssl ?
+	    WEBKIT_TLS_ERRORS_POLICY_FAIL : WEBKIT_TLS_ERRORS_POLICY_IGNORE);
+}
+
+/* Run after the arguments are parsed, so -a, -c and -q/-Q take effect. */
+static void
+setupcookies(void) {
+	WebKitCookieManager *cm;
+	SoupCookieJar *jar;
+	GSList *l, *cookies;
+	gchar *path;
+	gboolean migrate;
+
+	cm = webkit_web_context_get_cookie_manager(context);
+	cookiefile = buildpath(cookiefile);
+
+	if (cookiestorage == WEBKIT_COOKIE_PERSISTENT_STORAGE_TEXT) {
+		webkit_cookie_manager_set_persistent_storage(cm, cookiefile,
+		    WEBKIT_COOKIE_PERSISTENT_STORAGE_TEXT);
+	} else {
+		path = abspath(cookiedb);
+		migrate = !g_file_test(path, G_FILE_TEST_EXISTS);
+		g_free(path);
+
+		cookiedb = buildpath(cookiedb);
+		webkit_cookie_manager_set_persistent_storage(cm, cookiedb,
+		    WEBKIT_COOKIE_PERSISTENT_STORAGE_SQLITE);
+
+		/* one-time import of the text jar into a new database */
+		if (migrate) {
+			jar = soup_cookie_jar_text_new(cookiefile, TRUE);
+			cookies = soup_cookie_jar_all_cookies(jar);
+			for (l = cookies; l; l = l->next) {
+				webkit_cookie_manager_add_cookie(cm, l->data,
+				    NULL, NULL, NULL);
+				soup_cookie_free(l->data);
+			}
+			g_slist_free(cookies);
+			g_object_unref(jar);
+		}
+	}
+
+	webkit_cookie_manager_set_accept_policy(cm, getcookiepolicy());
+}
+
+static void
+setupsites(void) {
+	Site *s;
+
+	if (sites[0].host == NULL)
+		return;
+
+	sitetable = g_hash_table_new(g_str_hash, g_str_equal);
+	for (s = sites; s->host; s++)
+		g_hash_table_insert(sitetable, (gpointer)s->host, s);
+}
+
+static void
+setupstyles(void) {
+	stylefile = buildpath(stylefile);
+	styledir = buildpath(styledir);
+
+	/* the monitors are set up by deferinit() */
+	loadstyles();
+}
+
 static void
 show(WebKitWebView *v, struct _client *c) {
 	gtk_widget_show_all(c->win);
 	gtk_widget_grab_focus(GTK_WIDGET(c->view));
 }
 
+/*
+ * Switch c->settings to the rules of site s. Only a change of site
+ * touches them, so toggles stay in effect while browsing a site.
+ */
 static void
-sigchld(int unused) {
-	if (signal(SIGCHLD, sigchld) == SIG_ERR)
-		die("sigchld(): can't install SIGCHLD handler");
+siteapply(struct _client *c, const Site *s) {
+	const char *ua;
 
-	while(waitpid(-1, NULL, WNOHANG) > 0);
+	if (s == c->site)
+		return;
+	c->site = s;
+
+	g_object_set(G_OBJECT(c->settings),
+	    "enable-javascript", siteflag(s, 's', enablejavascript),
+	    "auto-load-images", siteflag(s, 'i', loadimages),
+	    "enable-plugins", siteflag(s, 'p', enableplugins), NULL);
+	if ((s == NULL || (ua = s->useragent) == NULL)
+	    && (ua = getenv("SURF_USERAGENT")) == NULL)
+		ua = useragent;
+	webkit_settings_set_user_agent(c->settings, ua);
+	if (c->view)
+		webkit_web_view_set_zoom_level(c->view,
+		    s && s->zoom ? s->zoom : zoomlevel);
+
+	gettogglestats(c);
+	updatetitle(c);
+}
+
+/* WebKit's cookie policy is global, so a site's cookies go afterwards. */
+static void
+sitecookies(const Site *s) {
+	webkit_website_data_manager_fetch(
+	    webkit_web_context_get_website_data_manager(context),
+	    WEBKIT_WEBSITE_DATA_COOKIES, NULL, sitecookiesfetched,
+	    (gpointer)s->host);
+}
+
+static void
+sitecookiesfetched(GObject *o, GAsyncResult *r, gpointer p) {
+	WebKitWebsiteDataManager *dm;
+	GList *data, *drop, *l;
+	const char *host, *name;
+
+	dm = WEBKIT_WEBSITE_DATA_MANAGER(o);
+	data = webkit_website_data_manager_fetch_finish(dm, r, NULL);
+	host = p;
+
+	/* data is kept per registrable domain, which may be above host */
+	drop = NULL;
+	for (l = data; l; l = l->next) {
+		name = webkit_website_data_get_name(l->data);
+		if (sitematch(name, host) || sitematch(host, name))
+			drop = g_list_prepend(drop, l->data);
+	}
+	if (drop)
+		webkit_website_data_manager_remove(dm,
+		    WEBKIT_WEBSITE_DATA_COOKIES, drop, NULL, NULL, NULL);
+
+	g_list_free(drop);
+	g_list_free_full(data, (GDestroyNotify)webkit_website_data_unref);
+}
+
+/* The value of setting f: off for f, on for F, else def. */
+static gboolean
+siteflag(const Site *s, char f, gboolean def) {
+	if (s == NULL || s->flags == NULL)
+		return def;
+	if (strchr(s->flags, f))
+		return FALSE;
+	if (strchr(s->flags, g_ascii_toupper(f)))
+		return TRUE;
+
+	return def;
+}
+
+/*
+ * The rule for the host of uri or for the nearest domain above it, found
+ * with one hash lookup per label of the host.
+ */
+static const Site *
+sitelookup(const char *uri) {
+	SoupURI *u;
+	const Site *s;
+	const char *h;
+
+	if (sitetable == NULL || uri == NULL
+	    || (u = soup_uri_new(uri)) == NULL)
+		return NULL;
+
+	s = NULL;
+	for (h = u->host; h && s == NULL; h = strchr(h, '.')) {
+		if (*h == '.')
+			h++;
+		s = g_hash_table_lookup(sitetable, h);
+	}
+	soup_uri_free(u);
+
+	return s;
+}
+
+/* Whether host is domain or below it. */
+static gboolean
+sitematch(const char *host, const char *domain) {
+	gsize h, d;
+
+	h = strlen(host);
+	d = strlen(domain);
+
+	return !g_ascii_strcasecmp(host, domain) || (h > d
+	    && host[h - d - 1] == '.'
+	    && !g_ascii_strcasecmp(host + h - d, domain));
 }
 
 static void
 spawn(struct _client *c, const union _arg *arg) {
-	if (fork() == 0) {
-		if (dpy)
-			close(ConnectionNumber(dpy));
-		setsid();
-		execvp(((char **)arg->v)[0], (char **)arg->v);
-		fprintf(stderr, "surf: execvp %s", ((char **)arg->v)[0]);
-		perror(" failed");
-		exit(0);
+	spawnargv((char **)arg->v, NULL, NULL);
+}
+
+/*
+ * Run argv without fork(), which copies the page tables of the whole
+ * browser: posix_spawn() shares the address space until the exec. GLib
+ * reaps the child, done gets its wait status and run time in us.
+ */
+static GPid
+spawnargv(char **argv, void (*done)(gint, gint64, gpointer), gpointer data) {
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	struct _child *ch;
+	gint64 started;
+	pid_t pid;
+	int err;
+
+	posix_spawn_file_actions_init(&fa);
+	if (dpy)
+		posix_spawn_file_actions_addclose(&fa, ConnectionNumber(dpy));
+	posix_spawnattr_init(&attr);
+#ifdef POSIX_SPAWN_SETSID
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID);
+#else
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+#endif
+
+	started = g_get_monotonic_time();
+	err = posix_spawnp(&pid, argv[0], &fa, &attr, argv, environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+	if (err) {
+		fprintf(stderr, "surf: spawn %s: %s\n", argv[0], strerror(err));
+		return 0;
 	}
+
+	ch = g_new(struct _child, 1);
+	ch->started = started;
+	ch->done = done;
+	ch->data = data;
+	g_child_watch_add(pid, spawned, ch);
+
+	return pid;
+}
+
+static void
+spawned(GPid pid, gint status, gpointer p) {
+	struct _child *ch;
+
+	ch = p;
+	if (ch->done)
+		ch->done(status, g_get_monotonic_time() - ch->started,
+		    ch->data);
+	g_spawn_close_pid(pid);
+	g_free(ch);
 }
 
 static void
@@ -952,12 +5164,32 @@ stop(struct _client *c, const union _arg *a) {
 	webkit_web_view_stop_loading(c->view);
 }
 
+static void
+stylechanged(GFileMonitor *m, GFile *f, GFile *o, GFileMonitorEvent e,
+    gpointer unused) {
+	switch (e) {
+	case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+	case G_FILE_MONITOR_EVENT_CREATED:
+	case G_FILE_MONITOR_EVENT_DELETED:
+		loadstyles();
+		break;
+	default:
+		break;
+	}
+}
+
 static void
 titlechanged(WebKitWebView *v, GParamSpec *s, struct _client *c) {
 	const gchar *t;
 
 	t = webkit_web_view_get_title(v);
 	c->title = copystr(&c->title, t);
+	/* the first title of a page goes to the history */
+	if (c->committed && !c->histtitled && t && *t) {
+		histlog(c, t);
+		c->histtitled = TRUE;
+	}
+	sessionchanged(c);
 	updatetitle(c);
 }
 
@@ -971,9 +5203,11 @@ toggle(struct _client *c, const union _arg *arg) {
 	name = (char *)arg->v;
 	a.b = FALSE;
 
-	settings = webkit_web_view_get_settings(c->view);
+	settings = c->settings;
 	g_object_get(G_OBJECT(settings), name, &value, NULL);
 	g_object_set(G_OBJECT(settings), name, !value, NULL);
+	gettogglestats(c);
+	sessionchanged(c);
 
 	reload(c, &a);
 }
@@ -983,14 +5217,17 @@ togglecookiepolicy(struct _client *c, const union _arg *arg)
 {
 	WebKitCookieManager *cm;
 
-	cm = webkit_web_context_get_cookie_manager(webkit_web_context_get_default());
+	cm = webkit_web_context_get_cookie_manager(context);
 
 	cookiepolicy++;
 	cookiepolicy %= strlen(cookiepolicies);
 
 	webkit_cookie_manager_set_accept_policy(cm, getcookiepolicy());
 
-	updatetitle(c);
+	for (c = clients; c; c = c->next) {
+		gettogglestats(c);
+		updatetitle(c);
+	}
 	/* Do not reload. */
 }
 
@@ -1006,87 +5243,318 @@ togglefullscreen(struct _client *c, const union _arg *arg) {
 
 static void
 togglegeolocation(struct _client *c, const union _arg *arg) {
+	struct _client *n;
 	union _arg a;
 
 	a.b = FALSE;
 	allowgeolocation = !allowgeolocation;
+	for (n = clients; n; n = n->next)
+		gettogglestats(n);
 
 	reload(c, &a);
 }
 
+/* Styles live in the shared content manager, so this affects all windows. */
 static void
 togglestyle(struct _client *c, const union _arg *arg) {
-	WebKitUserContentManager *cm;
-	WebKitUserStyleSheet *ss;
-	gchar *style;
-
-	cm = webkit_web_view_get_user_content_manager(c->view);
+	styled = !styled;
+	applystyles();
 
-	if (c->styled) {
-		webkit_user_content_manager_remove_all_style_sheets(cm);
-		c->styled = FALSE;
-	} else {
-		g_file_get_contents(stylefile, &style, NULL, NULL);
-		if (style) {
-			ss = webkit_user_style_sheet_new(style,
-			    WEBKIT_USER_CONTENT_INJECT_ALL_FRAMES, WEBKIT_USER_STYLE_LEVEL_USER,
-			    stylewhitelist, styleblacklist);
-			webkit_user_content_manager_add_style_sheet(cm, ss);
-			g_free(style);
-			c->styled = TRUE;
-		}
+	for (c = clients; c; c = c->next) {
+		gettogglestats(c);
+		updatetitle(c);
 	}
+}
 
-	updatetitle(c);
+/* With SURF_TRACE set, log ms since the start to it, "-" for stderr. */
+static void
+trace(const char *phase) {
+	if (tracefp == NULL)
+		return;
+	fprintf(tracefp, "surf2 %d %9.3f ms %s\n", getpid(),
+	    (g_get_monotonic_time() - tracestart) / 1e3, phase);
+	fflush(tracefp);
+}
+
+static void
+updatepoolstats(void) {
+	struct _client *c;
+	char buf[64];
+
+	snprintf(buf, sizeof(buf), "pool hits %u misses %u",
+	    poolhits, poolmisses);
+	for (c = clients; c; c = c->next)
+		setatom(c, ATOMSTATS, buf);
 }
 
+/*
+ * Titles change on every progress step and mouse movement, so they are
+ * only rendered once the main loop is idle.
+ */
 static void
 updatetitle(struct _client *c) {
-	gchar *t;
+	if (!c->titleidle)
+		c->titleidle = g_idle_add(flushtitle, c);
+}
 
-	if (showindicators) {
-		gettogglestats(c);
-		getpagestats(c);
+static void
+updatewinid(struct _client *c) {
+	snprintf(winid, LENGTH(winid), "%lu", c->xwin);
+}
 
-		if (c->progress < 100)
-			t = g_strdup_printf("[%i%%] ", c->progress);
-		else
-			t = g_strdup_printf("");
+static void
+usage(void) {
+	die("usage: %s [-fFgGiIjJkKmMnNpPqQRsSvwWxyY]"
+	    " [-a cookiepolicies ] [-B batchfile] [-o outdir]"
+	    " [-c cookiefile] [-C cachedir] [-l cachelimit]"
+	    " [-e xid] [-H query] [-r scriptfile]"
+	    " [-t stylefile] [-u useragent] [-U webprocesses]"
+	    " [-z zoomlevel]"
+	    " [uri]\n", basename(argv0));
+}
+
+/* Drops a character snprintf() cut in half at the end of s. */
+static void
+utf8cut(char *s) {
+	char *p;
 
-		t = g_strdup_printf("%s%s:%s", t, togglestats, pagestats);
+	if (*s == '\0')
+		return;
+	p = g_utf8_find_prev_char(s, s + strlen(s));
+	if (p && !g_utf8_validate(p, -1, NULL))
+		*p = '\0';
+}
 
+/* Rebuild a discarded or restored view, see discard(). */
+static void
+wake(struct _client *c) {
+	WebKitBackForwardListItem *item;
 
-		if (c->hoveruri) {
-			t = g_strdup_printf("%s > %s",
-			    t, c->hoveruri);
-			if (c->hovertitle)
-				t = g_strdup_printf("%s [%s]", t, c->hovertitle);
-		} else
-			t = g_strdup_printf("%s | %s",
-			    t, (c->title == NULL) ? "" : c->title);
+	c->lastseen = g_get_monotonic_time();
+	c->discarding = FALSE;
+	c->placeholder = FALSE;
+	if (c->view)
+		return;
 
-		if (c->hovercontent)
-			t = g_strdup_printf("%s <%s>", t, c->hovercontent);
+	newview(c);
+	webkit_web_view_set_zoom_level(c->view, c->zoom);
+	gtk_widget_show(GTK_WIDGET(c->view));
+	if (gtk_window_is_active(GTK_WINDOW(c->win)))
+		gtk_widget_grab_focus(GTK_WIDGET(c->view));
 
-		gtk_window_set_title(GTK_WINDOW(c->win), t);
-		g_free(t);
-	} else
-		gtk_window_set_title(GTK_WINDOW(c->win),
-		    (c->title == NULL) ? "" : c->title);
+	if (c->session) {
+		webkit_web_view_restore_session_state(c->view, c->session);
+		webkit_web_view_session_state_unref(c->session);
+		c->session = NULL;
+	}
+
+	item = webkit_back_forward_list_get_current_item(
+	    webkit_web_view_get_back_forward_list(c->view));
+	if (item)
+		webkit_web_view_go_to_back_forward_list_item(c->view, item);
+	else if (c->sessionuri)
+		webkit_web_view_load_uri(c->view, c->sessionuri);
 }
 
+/* pick up edits of the style sheets without a restart */
 static void
-updatewinid(struct _client *c) {
-	snprintf(winid, LENGTH(winid), "%lu", c->xwin);
+watchstyles(void) {
+	GFile *f;
+
+	f = g_file_new_for_path(stylefile);
+	stylemon = g_file_monitor_file(f, G_FILE_MONITOR_NONE, NULL, NULL);
+	g_object_unref(f);
+	f = g_file_new_for_path(styledir);
+	styledirmon = g_file_monitor_directory(f, G_FILE_MONITOR_NONE, NULL,
+	    NULL);
+	g_object_unref(f);
+	if (stylemon)
+		g_signal_connect(stylemon, "changed",
+		    G_CALLBACK(stylechanged), NULL);
+	if (styledirmon)
+		g_signal_connect(styledirmon, "changed",
+		    G_CALLBACK(stylechanged), NULL);
+}
+
+/*
+ * WebKit has no API for the web process of a view. At every commit a view
+ * takes the pid of another window in its process group, or else the web
+ * process that no other window, pooled window or prerender claims. One
+ * other than its last means a navigation swapped the process. The pid
+ * stays unknown when there are several.
+ */
+static pid_t
+webprocclaim(struct _client *c, WebKitWebView *v) {
+	struct _client *lists[] = { clients, pool }, *p;
+	GArray *pids;
+	pid_t pid, last, found;
+	gboolean lastfree;
+	guint i, n;
+
+	if (v == c->view)
+		for (i = 0; i < LENGTH(lists); i++)
+			for (p = lists[i]; p; p = p->next)
+				if (p != c && p->procgroup == c->procgroup
+				    && p->webpid)
+					return p->webpid;
+
+	pids = g_array_new(FALSE, FALSE, sizeof(pid_t));
+	webprocs(pids);
+
+	last = v == c->view ? c->webpid : c->prerenderpid;
+	found = 0;
+	lastfree = FALSE;
+	for (n = 0, i = 0; i < pids->len; i++) {
+		pid = g_array_index(pids, pid_t, i);
+		if (pids->len > 1 && webprocclaimed(c, v, pid))
+			continue;
+		if (pid == last) {
+			lastfree = TRUE;
+			continue;
+		}
+		found = pid;
+		n++;
+	}
+	if (n == 0 && lastfree) {
+		found = last;
+		n = 1;
+	}
+
+	g_array_free(pids, TRUE);
+
+	return n == 1 ? found : 0;
+}
+
+/* Whether a view other than v of c claims pid. */
+static gboolean
+webprocclaimed(struct _client *c, WebKitWebView *v, pid_t pid) {
+	struct _client *lists[] = { clients, pool }, *p;
+	guint i;
+
+	for (i = 0; i < LENGTH(lists); i++)
+		for (p = lists[i]; p; p = p->next)
+			if ((p->webpid == pid && (p != c || v != p->view))
+			    || (p->prerenderpid == pid
+			    && (p != c || v != p->prerender)))
+				return TRUE;
+
+	return FALSE;
 }
 
+/* The web processes started by this surf2. */
 static void
-usage(void) {
-	die("usage: %s [-fFgGiIjJkKnNpPsSvx]"
-	    " [-a cookiepolicies ] "
-	    " [-c cookiefile] [-e xid] [-r scriptfile]"
-	    " [-t stylefile] [-u useragent] [-z zoomlevel]"
-	    " [uri]\n", basename(argv0));
+webprocs(GArray *pids) {
+	GDir *d;
+	const gchar *name;
+	gchar *path, *stat, *s;
+	pid_t pid, ppid;
+
+	if ((d = g_dir_open("/proc", 0, NULL)) == NULL)
+		return;
+	while ((name = g_dir_read_name(d)) != NULL) {
+		if ((pid = strtol(name, &s, 10)) <= 0 || *s)
+			continue;
+		path = g_strdup_printf("/proc/%s/stat", name);
+		if (g_file_get_contents(path, &stat, NULL, NULL)) {
+			/* "pid (comm) state ppid", comm cut at 15 bytes */
+			if ((s = strrchr(stat, ')')) != NULL
+			    && sscanf(s + 1, " %*c %d", &ppid) == 1
+			    && ppid == getpid()
+			    && strstr(stat, "(WebKitWebProces)"))
+				g_array_append_val(pids, pid);
+			g_free(stat);
+		}
+		g_free(path);
+	}
+	g_dir_close(d);
+}
+
+/*
+ * The windows sharing a web process form a group. Below the limit of
+ * web processes a view starts a group of its own, at the limit it is
+ * related to a view of the smallest group, which shares its process.
+ */
+static WebKitWebView *
+webprocshare(struct _client *c) {
+	struct _client *lists[] = { clients, pool }, *p, *best;
+	GHashTable *sizes;
+	gpointer g;
+	guint limit, i;
+
+	limit = processmodel == WEBKIT_PROCESS_MODEL_SHARED_SECONDARY_PROCESS
+	    ? 1 : webprocesslimit;
+
+	sizes = g_hash_table_new(NULL, NULL);
+	for (i = 0; i < LENGTH(lists); i++)
+		for (p = lists[i]; p; p = p->next) {
+			if (p == c || p->view == NULL)
+				continue;
+			g = GUINT_TO_POINTER(p->procgroup);
+			g_hash_table_insert(sizes, g, GUINT_TO_POINTER(
+			    GPOINTER_TO_UINT(g_hash_table_lookup(sizes, g))
+			    + 1));
+		}
+
+	best = NULL;
+	if (limit && g_hash_table_size(sizes) >= limit)
+		for (i = 0; i < LENGTH(lists); i++)
+			for (p = lists[i]; p; p = p->next)
+				if (p != c && p->view && (best == NULL
+				    || GPOINTER_TO_UINT(g_hash_table_lookup(
+				    sizes, GUINT_TO_POINTER(p->procgroup)))
+				    < GPOINTER_TO_UINT(g_hash_table_lookup(
+				    sizes, GUINT_TO_POINTER(best->procgroup)))))
+					best = p;
+	g_hash_table_destroy(sizes);
+
+	if (best == NULL) {
+		c->procgroup = ++procgroups;
+		return NULL;
+	}
+	c->procgroup = best->procgroup;
+
+	return best->view;
+}
+
+/* Resident set in KiB and CPU time in s of process pid. */
+static gboolean
+webprocstat(pid_t pid, guint64 *rss, gdouble *cpu) {
+	gchar *path, *stat, *s;
+	unsigned long utime, stime;
+	long pages;
+	gboolean ok;
+
+	path = g_strdup_printf("/proc/%d/stat", (int)pid);
+	ok = g_file_get_contents(path, &stat, NULL, NULL);
+	g_free(path);
+	if (!ok)
+		return FALSE;
+
+	/* fields 14, 15 and 24 of proc(5) */
+	ok = (s = strrchr(stat, ')')) != NULL
+	    && sscanf(s + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u"
+	    " %lu %lu %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+	    &utime, &stime, &pages) == 3;
+	g_free(stat);
+	if (!ok)
+		return FALSE;
+
+	*rss = (guint64)pages * sysconf(_SC_PAGESIZE) / 1024;
+	*cpu = (gdouble)(utime + stime) / sysconf(_SC_CLK_TCK);
+
+	return TRUE;
+}
+
+static gboolean
+winevent(GtkWidget *w, GdkEvent *e, struct _client *c) {
+	/* leaving the window starts its idle time */
+	if (e->type == GDK_FOCUS_CHANGE && !e->focus_change.in)
+		c->lastseen = g_get_monotonic_time();
+	/* restored windows are all mapped at once, load on focus only */
+	else if (e->type != GDK_MAP || !c->placeholder)
+		wake(c);
+
+	return FALSE;
 }
 
 static void
@@ -1104,24 +5572,33 @@ zoom(struct _client *c, const union _arg *arg) {
 		/* reset */
 		webkit_web_view_set_zoom_level(c->view, 1.0);
 	}
+	sessionchanged(c);
 }
 
 int
 main(int argc, char *argv[]) {
 	union _arg arg;
 	struct _client *c;
+	GString *out;
 
 	memset(&arg, 0, sizeof(arg));
 
-	setup(&argc, &argv);
+	/* takes --display and the like, without opening the display */
+	gtk_parse_args(&argc, &argv);
 
 	ARGBEGIN {
 	case 'a':
 		cookiepolicies = EARGF(usage());
 		break;
+	case 'B':
+		batchfile = EARGF(usage());
+		break;
 	case 'c':
 		cookiefile = EARGF(usage());
 		break;
+	case 'C':
+		cachedir = EARGF(usage());
+		break;
 	case 'e':
 		embed = strtol(EARGF(usage()), NULL, 0);
 		break;
@@ -1137,6 +5614,9 @@ main(int argc, char *argv[]) {
 	case 'G':
 		allowgeolocation = 1;
 		break;
+	case 'H':
+		histquery = EARGF(usage());
+		break;
 	case 'i':
 		loadimages = 0;
 		break;
@@ -1155,21 +5635,42 @@ main(int argc, char *argv[]) {
 	case 'K':
 		kioskmode = 1;
 		break;
+	case 'l':
+		cachelimit = strtoul(EARGF(usage()), NULL, 0);
+		break;
+	case 'm':
+		cachemodel = WEBKIT_CACHE_MODEL_DOCUMENT_VIEWER;
+		break;
+	case 'M':
+		cachemodel = WEBKIT_CACHE_MODEL_WEB_BROWSER;
+		break;
 	case 'n':
 		enableinspector = 0;
 		break;
 	case 'N':
 		enableinspector = 1;
 		break;
+	case 'o':
+		outdir = EARGF(usage());
+		break;
 	case 'p':
 		enableplugins = 0;
 		break;
 	case 'P':
 		enableplugins = 1;
 		break;
+	case 'q':
+		cookiestorage = WEBKIT_COOKIE_PERSISTENT_STORAGE_TEXT;
+		break;
+	case 'Q':
+		cookiestorage = WEBKIT_COOKIE_PERSISTENT_STORAGE_SQLITE;
+		break;
 	case 'r':
 		scriptfile = EARGF(usage());
 		break;
+	case 'R':
+		restore = true;
+		break;
 	case 's':
 		enablejavascript = 0;
 		break;
@@ -1182,12 +5683,27 @@ main(int argc, char *argv[]) {
 	case 'u':
 		useragent = EARGF(usage());
 		break;
+	case 'U':
+		webprocesslimit = strtoul(EARGF(usage()), NULL, 0);
+		break;
 	case 'v':
 		die("surf-"VERSION", ©2009-2014 surf engineers, "
 		    "see LICENSE for details\n");
+	case 'w':
+		inprocesswindows = 0;
+		break;
+	case 'W':
+		inprocesswindows = 1;
+		break;
 	case 'x':
 		showwinid = TRUE;
 		break;
+	case 'y':
+		processmodel = WEBKIT_PROCESS_MODEL_SHARED_SECONDARY_PROCESS;
+		break;
+	case 'Y':
+		processmodel = WEBKIT_PROCESS_MODEL_MULTIPLE_SECONDARY_PROCESSES;
+		break;
 	case 'z':
 		zoomlevel = strtof(EARGF(usage()), NULL);
 		break;
@@ -1198,13 +5714,59 @@ main(int argc, char *argv[]) {
 	if (argc > 0)
 		arg.v = argv[0];
 
-	c = newclient();
-	show(NULL, c);
+	/* -H reads the history and its index, no display is needed */
+	if (histquery) {
+		if (historyfile)
+			historyfile = abspath(historyfile);
+		out = g_string_new(NULL);
+		histcomplete(out, histquery, FALSE);
+		fputs(out->str, stdout);
+		g_string_free(out, TRUE);
 
-	if (arg.v)
-		loaduri(c, &arg);
+		return EXIT_SUCCESS;
+	}
+
+	setup();
+	setupcontext();
+	trace("context");
+	setupcookies();
+	trace("cookies");
+	loadscripts();
+	setupstyles();
+	setupsites();
+	trace("scripts");
+
+	if (batchfile) {
+		if (batch())
+			gtk_main();
+		cleanup();
+
+		return batcherrors ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (!restore || !restoresession() || arg.v) {
+		c = newclient(embed, false);
+		trace("window");
+
+		/* request the page before the window is mapped */
+		if (arg.v)
+			loaduri(c, &arg);
+		else
+			updatetitle(c);
+		trace("load");
+		show(NULL, c);
+		trace("show");
+	}
+
+	/* a blank window or a failing load would wait for deferdelay */
+	if (arg.v == NULL && !restore)
+		deferinit(NULL);
 	else
-		updatetitle(c);
+		defertimer = g_timeout_add(deferdelay, deferinit, NULL);
+
+	if (inprocesswindows && poolsize)
+		poolfiller = g_idle_add_full(G_PRIORITY_LOW, fillpool,
+		    NULL, NULL);
 
 	gtk_main();
 